@@ -24,13 +24,14 @@
 
 
 BlockFile::BlockFile(Buffer& buf, unsigned int block_id, bool hidden) :
-        BlockFile(buf, buf.block(block_id, hidden)) {
+        BlockFile(buf, buf.block(block_id, hidden, CachePriority::METADATA)) {
 }
 
 BlockFile::BlockFile(Buffer& buf, BlockAccessor&& header_acc) :
         buffer(buf), header_acc(std::move(header_acc)), tree(buf, this->header_acc, BLOCK_TREE_OFFSET) {
 
     ensure(this->header_acc.read()[0] == FILE_TYPE, "BlockFile::BlockFile") << "This block is not a file header";
+    buffer.noteTreeDepth(tree.depth());
 }
 
 BlockFile::BlockFile(BlockFile&& other) :
@@ -73,29 +74,29 @@ void BlockFile::truncate() {
 }
 
 BlockFile BlockFile::newFile(Buffer& buffer, bool hidden) {
-    auto acc = buffer.allocateBlock(hidden);
-    auto& data = acc.writable();
+    auto acc = buffer.allocateBlock(hidden, CachePriority::METADATA);
+    auto data = acc.writable();
     intToBytes(&data[0], FILE_TYPE);
     intToBytes(&data[BLOCK_TREE_OFFSET], 0);
     return {buffer, std::move(acc)};
 }
 
 BlockFileIterator BlockFile::begin() {
-    return {*this, 0};
+    return {*this, 0, AccessMode::EXCLUSIVE};
 }
 
-BlockFileIterator BlockFile::iter(unsigned int start) {
-    return {*this, start};
+BlockFileIterator BlockFile::iter(unsigned int start, AccessMode mode) {
+    return {*this, start, mode};
 }
 
 BlockFileIterator BlockFile::end() {
-    return {*this, numberOfBlocks()};
+    return {*this, numberOfBlocks(), AccessMode::EXCLUSIVE};
 }
 
-BlockFileIterator::BlockFileIterator(BlockFile& file, unsigned int start) :
-        file(file), very_start(start == 0), iter(file.tree.iter(start == 0 ? 0 : start - 1)) {
+BlockFileIterator::BlockFileIterator(BlockFile& file, unsigned int start, AccessMode mode) :
+        file(file), mode(mode), very_start(start == 0), iter(file.tree.iter(start == 0 ? 0 : start - 1)) {
     if (!iter.at_end() && !very_start) {
-        node_acc = std::make_unique<BlockAccessor>(file.buffer.block(*iter, file.header_acc.block_id().first));
+        node_acc = std::make_unique<BlockAccessor>(file.buffer.block(*iter, file.header_acc.block_id().first, CachePriority::DATA, mode));
     }
 }
 
@@ -115,7 +116,7 @@ BlockFileIterator& BlockFileIterator::operator++() {
         ++iter;
     }
     if (!iter.at_end()) {
-        node_acc = std::make_unique<BlockAccessor>(file.buffer.block(*iter, file.header_acc.block_id().first));
+        node_acc = std::make_unique<BlockAccessor>(file.buffer.block(*iter, file.header_acc.block_id().first, CachePriority::DATA, mode));
     }
     return *this;
 }
@@ -131,7 +132,7 @@ BlockFileIterator& BlockFileIterator::operator--() {
         node_acc.reset();
     }
     else if (!iter.at_end()) {
-        node_acc = std::make_unique<BlockAccessor>(file.buffer.block(*iter, file.header_acc.block_id().first));
+        node_acc = std::make_unique<BlockAccessor>(file.buffer.block(*iter, file.header_acc.block_id().first, CachePriority::DATA, mode));
     }
     return *this;
 }
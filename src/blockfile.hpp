@@ -31,12 +31,13 @@ struct FileBlock {
 
 class BlockFileIterator {
     BlockFile& file;
+    AccessMode mode;
     bool very_start = true;
     BlockTreeIterator iter;
     std::unique_ptr<BlockAccessor> node_acc;
 
 public:
-    BlockFileIterator(BlockFile& file, unsigned int start);
+    BlockFileIterator(BlockFile& file, unsigned int start, AccessMode mode);
     FileBlock operator*();
     BlockFileIterator& operator++();
     void operator++(int) { ++*this; }
@@ -68,7 +69,8 @@ public:
     void removeBlock();
     void truncate();
 
-    BlockFileIterator iter(unsigned int start);
+    // Data blocks are held in the given mode, but the header is the file's own accessor
+    BlockFileIterator iter(unsigned int start, AccessMode mode = AccessMode::EXCLUSIVE);
     BlockFileIterator begin();
     BlockFileIterator end();
 
@@ -20,6 +20,7 @@
 #include "utilities.hpp"
 #include "consts.hpp"
 
+#include <cstring>
 #include <iostream>
 
 // Pair of offset, size of node to the insertion / deletion point
@@ -43,6 +44,10 @@ unsigned int BlockTree::numberOfBlocks() const {
     return intFromBytes(&acc.read()[offset]);
 }
 
+unsigned int BlockTree::depth() const {
+    return levels(numberOfBlocks()).size() - 1;
+}
+
 void BlockTree::add(unsigned int value) {
     auto path = levels(numberOfBlocks());
     auto before_path = levels(numberOfBlocks() - 1);
@@ -56,10 +61,11 @@ void BlockTree::add(unsigned int value) {
 
     if (path.size() != before_path.size()) {
         // Split
-        auto node_acc = buffer.allocateBlock(hidden);
-        node_acc.writable().replace(0, 4 * NUM_HEADER_BLOCK_TREE_ENTRIES, &acc.read()[offset + 4], 4 * NUM_HEADER_BLOCK_TREE_ENTRIES);
+        auto node_acc = buffer.allocateBlock(hidden, CachePriority::METADATA);
+        memcpy(node_acc.writable(), &acc.read()[offset + 4], 4 * NUM_HEADER_BLOCK_TREE_ENTRIES);
         intToBytes(&acc.writable()[offset + 4], node_acc.block_id().second);
         before_path.push_back(0);
+        buffer.noteTreeDepth(depth());
     }
 
     unsigned int block_id;
@@ -67,7 +73,7 @@ void BlockTree::add(unsigned int value) {
 
     if (path.back() != before_path.back()) {
         need_to_allocate = true;
-        block_id = buffer.allocateBlock(hidden).block_id().second;
+        block_id = buffer.allocateBlock(hidden, CachePriority::METADATA).block_id().second;
         intToBytes(&acc.writable()[offset + 4 + 4 * path.back()], block_id);
     }
     else {
@@ -75,11 +81,11 @@ void BlockTree::add(unsigned int value) {
     }
 
     for (unsigned int level = 1; level < path.size() - 1; ++level) {
-        auto node_acc = buffer.block(block_id, hidden);
+        auto node_acc = buffer.block(block_id, hidden, CachePriority::METADATA);
         auto pos = path.size() - level - 1;
         if (pos && (need_to_allocate || path[pos] != before_path[pos])) {
             need_to_allocate = true;
-            block_id = buffer.allocateBlock(hidden).block_id().second;
+            block_id = buffer.allocateBlock(hidden, CachePriority::METADATA).block_id().second;
             intToBytes(&node_acc.writable()[4 * path[pos]], block_id);
         }
         else {
@@ -87,7 +93,7 @@ void BlockTree::add(unsigned int value) {
         }
     }
 
-    auto node_acc = buffer.block(block_id, hidden);
+    auto node_acc = buffer.block(block_id, hidden, CachePriority::METADATA);
     intToBytes(&node_acc.writable()[4 * path.front()], value);
 }
 
@@ -108,7 +114,7 @@ unsigned int BlockTree::remove() {
     std::vector<unsigned int> deallocate;
 
     for (unsigned int level = 1; level < path.size() - 1; ++level) {
-        auto node_acc = buffer.block(block_id, hidden);
+        auto node_acc = buffer.block(block_id, hidden, CachePriority::METADATA);
         auto pos = path.size() - level - 1;
         if (!path[pos]) {
             deallocate.push_back(block_id);
@@ -121,7 +127,7 @@ unsigned int BlockTree::remove() {
 
     unsigned int value;
     {
-        auto node_acc = buffer.block(block_id, hidden);
+        auto node_acc = buffer.block(block_id, hidden, CachePriority::METADATA);
         value = intFromBytes(&node_acc.read()[4 * path.front()]);
         if (!path.front()) {
             deallocate.push_back(block_id);
@@ -138,8 +144,8 @@ unsigned int BlockTree::remove() {
     if (path.size() != after_path.size()) {
         auto deall_id = intFromBytes(&acc.read()[offset + 4]);
         {
-            auto node_acc = buffer.block(deall_id, hidden);
-            acc.writable().replace(offset + 4, 4 * NUM_HEADER_BLOCK_TREE_ENTRIES, &node_acc.read()[0], 4 * NUM_HEADER_BLOCK_TREE_ENTRIES);
+            auto node_acc = buffer.block(deall_id, hidden, CachePriority::METADATA);
+            memcpy(&acc.writable()[offset + 4], node_acc.read(), 4 * NUM_HEADER_BLOCK_TREE_ENTRIES);
         }
         buffer.deallocateBlock(deall_id, hidden);
     }
@@ -162,7 +168,7 @@ void print_node_single(unsigned int block_id, unsigned int levels, unsigned int
 void print_node_full(Buffer& buf, unsigned int block_id, bool hidden, unsigned int levels, unsigned int total_levels) {
     print_node_single(block_id, levels, total_levels);
     if (levels) {
-        auto acc = buf.block(block_id, hidden);
+        auto acc = buf.block(block_id, hidden, CachePriority::METADATA);
         for (unsigned int i = 0; i < NUM_TREE_BLOCK_TREE_ENTRIES; ++i) {
             print_node_full(buf, intFromBytes(&acc.read()[4 * i]), hidden, levels - 1, total_levels);
         }
@@ -188,7 +194,7 @@ void BlockTree::debug() {
     for (unsigned int level = 1; level <= path.size(); ++level) {
         print_node_single(block_id, path.size() - level, path.size());
         if (level != path.size()) {
-            auto node_acc = buffer.block(block_id, acc.block_id().first);
+            auto node_acc = buffer.block(block_id, acc.block_id().first, CachePriority::METADATA);
             for (unsigned int i = 0; i < path[path.size() - level - 1]; ++i) {
                 print_node_full(buffer, intFromBytes(&node_acc.read()[4 * i]), acc.block_id().first, path.size() - 1 - level, path.size());
             }
@@ -241,7 +247,7 @@ void BlockTreeIterator::updateAccessors(unsigned int start_level) {
         block_id = intFromBytes(&accessors.back().read()[4 * positions[positions.size() - start_level - 1]]);
     }
     for (unsigned int i = start_level + 1; i < positions.size(); ++i) {
-        auto node_acc = tree.buffer.block(block_id, hidden);
+        auto node_acc = tree.buffer.block(block_id, hidden, CachePriority::METADATA, AccessMode::SHARED);
         block_id = intFromBytes(&node_acc.read()[4 * positions[positions.size() - i - 1]]);
         accessors.emplace_back(std::move(node_acc));
     }
@@ -25,6 +25,7 @@
 
 class BlockTree;
 
+// Only reads the nodes, so holds them shared
 class BlockTreeIterator {
     const BlockTree& tree;
     std::vector<BlockAccessor> accessors;
@@ -55,6 +56,8 @@ public:
     BlockTree(Buffer& buf, BlockAccessor& acc, unsigned int offset);
 
     unsigned int numberOfBlocks() const;
+    // Levels of nodes below the header
+    unsigned int depth() const;
 
     void add(unsigned int value);
     unsigned int remove();
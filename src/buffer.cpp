@@ -23,24 +23,91 @@
 
 #include "cryptopp/osrng.h"
 
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <exception>
+#include <functional>
 #include <iostream>
+#include <numeric>
 
 const unsigned int VIRTUAL_BLOCK = -2;
 
-BlockCacheEntry::BlockCacheEntry() : data(LOGICAL_BLOCK_SIZE, '\xff') {
+// Packed reverse mapping entries: free and virtual blocks use the same values as in the mapping table,
+// and otherwise the entry is the logical block ID with the top bit set for the hidden aspect
+const std::uint32_t FREE_MAPPING_ENTRY = NO_BLOCK_ASSIGNED;
+const std::uint32_t VIRTUAL_MAPPING_ENTRY = VIRTUAL_BLOCK;
+const std::uint32_t HIDDEN_MAPPING_ENTRY = 0x80000000;
+// Hidden IDs must stay clear of the two reserved values once the top bit is set
+const unsigned int MAX_LOGICAL_BLOCK_ID = VIRTUAL_MAPPING_ENTRY - HIDDEN_MAPPING_ENTRY - 1;
+
+std::uint32_t packMappingEntry(std::pair<bool, unsigned int> logical_block_id) {
+    auto [hidden, block_id] = logical_block_id;
+    if (block_id == NO_BLOCK_ASSIGNED || block_id == VIRTUAL_BLOCK) {
+        return block_id;
+    }
+    return hidden ? block_id | HIDDEN_MAPPING_ENTRY : block_id;
+}
+
+std::pair<bool, unsigned int> unpackMappingEntry(std::uint32_t entry) {
+    if (entry >= VIRTUAL_MAPPING_ENTRY) {
+        return {entry == VIRTUAL_MAPPING_ENTRY, entry};
+    }
+    return {entry & HIDDEN_MAPPING_ENTRY, entry & ~HIDDEN_MAPPING_ENTRY};
+}
+
+// Unbiased random number in [0, bound), using Lemire's multiply-and-reject method
+unsigned int random_below(CryptoPP::RandomNumberGenerator& rng, unsigned int bound) {
+    uint64_t product = static_cast<uint64_t>(rng.GenerateWord32()) * bound;
+    auto low = static_cast<uint32_t>(product);
+    if (low < bound) {
+        uint32_t threshold = -bound % bound;
+        while (low < threshold) {
+            product = static_cast<uint64_t>(rng.GenerateWord32()) * bound;
+            low = static_cast<uint32_t>(product);
+        }
+    }
+    return product >> 32;
+}
+
+// Remove a uniformly random element in O(1), swapping the last element into its place
+template<class T> T take_random(std::vector<T>& vec, CryptoPP::RandomNumberGenerator& rng) {
+    auto idx = random_below(rng, vec.size());
+    auto value = vec[idx];
+    vec[idx] = vec.back();
+    vec.pop_back();
+    return value;
+}
+
+// Metadata operations, which are admitted ahead of bulk reads and writes
+bool isInteractive(OperationType type) {
+    return type == OperationType::LOOKUP || type == OperationType::CREATE || type == OperationType::REMOVE || type == OperationType::RENAME;
 }
 
-BlockAccessor::BlockAccessor(Buffer& buffer, BlockCacheEntry& cache_entry) : buffer_(buffer), cache_entry(cache_entry) {
+// Only ever raises the value, so racing updates keep the largest
+void raise_to(std::atomic<unsigned int>& value, unsigned int at_least) {
+    auto current = value.load(std::memory_order_relaxed);
+    while (current < at_least && !value.compare_exchange_weak(current, at_least, std::memory_order_relaxed)) {
+    }
+}
+
+// The operation running on this thread, owned by its BufferOperation
+thread_local BufferOperationData* current_operation_data = nullptr;
+
+BlockCacheEntry::BlockCacheEntry(unsigned char* data) : data(data) {
+}
+
+BlockAccessor::BlockAccessor(Buffer& buffer, BlockCacheEntry& cache_entry, bool shared) : buffer_(buffer), cache_entry(cache_entry), shared(shared) {
     // Lock baton is passed from Buffer::block
 }
 
-BlockAccessor::BlockAccessor(BlockAccessor&& other) : buffer_(other.buffer_), cache_entry(other.cache_entry) {
+BlockAccessor::BlockAccessor(BlockAccessor&& other) : buffer_(other.buffer_), cache_entry(other.cache_entry), shared(other.shared) {
     other.moved = true;
 }
 
 BlockAccessor::~BlockAccessor() {
     if (!moved) {
-        buffer_.return_block(cache_entry);
+        buffer_.return_block(cache_entry, shared);
     }
 }
 
@@ -49,13 +116,14 @@ Buffer& BlockAccessor::buffer() const {
 }
 
 
-const secure_string& BlockAccessor::read() const {
+const unsigned char* BlockAccessor::read() const {
     ensure(!moved, "BlockAccessor::read") << "Accessor has been moved";
     return cache_entry.data;
 }
 
-secure_string& BlockAccessor::writable() {
+unsigned char* BlockAccessor::writable() {
     ensure(!moved, "BlockAccessor::writable") << "Accessor has been moved";
+    ensure(!shared, "BlockAccessor::writable") << "Accessor is shared";
     cache_entry.dirtied_by_current = true;
     return cache_entry.data;
 }
@@ -65,14 +133,11 @@ std::pair<bool, unsigned int> BlockAccessor::block_id() const {
     return cache_entry.logical_block_id;
 }
 
-Buffer::Buffer(Disk& disk, unsigned int cache_size, bool wipe_mapping_table, bool enforce_operations, bool debug, bool no_hidden) :
-        disk(disk), cache(cache_size), enforce_operations(enforce_operations), debug(debug), no_hidden(no_hidden) {
-    wait_for_flush_done.lock();
-    wait_for_ops_done.lock();
-
-    for (auto i = 0u; i < cache.size(); ++i) {
-        least_recently_used.push_back(i);
-    }
+Buffer::Buffer(Disk& disk, unsigned int cache_size, unsigned int mapping_cache_size, unsigned int hidden_cache_share, bool cache_borrowing, unsigned int locality, bool wipe_mapping_table, bool enforce_operations, bool debug, bool no_hidden) :
+        disk(disk), mapping_cache_size(std::max(mapping_cache_size, 1u)), slab(std::max(cache_size, std::min(disk.numberOfBlocks(), MAX_CACHE_SIZE)), PHYSICAL_BLOCK_SIZE),
+        target_cache_size(cache_size), hidden_cache_share(no_hidden ? 0 : std::min(hidden_cache_share, 100u)), cache_borrowing(cache_borrowing),
+        locality(std::max(locality, 1u)), enforce_operations(enforce_operations), debug(debug), no_hidden(no_hidden) {
+    growCache();
 
     while (number_of_mapping_blocks * MAPPING_POINTERS_PER_BLOCK < disk.numberOfBlocks() - number_of_mapping_blocks * 2) {
         ++number_of_mapping_blocks;
@@ -88,83 +153,281 @@ Buffer::Buffer(Disk& disk, unsigned int cache_size, bool wipe_mapping_table, boo
         }
     }
 
+    mapping_pages.resize(number_of_mapping_blocks);
     scanEntriesTable();
 
-    for (auto item : block_mapping) {
-        if (item.first.first) {
-            max_hidden_id = std::max(max_hidden_id, item.first.second + 1);
+    // The gaps in the logical IDs make up the reuse pools
+    for (auto block_id = 0u; block_id < cover_block_mapping.size(); ++block_id) {
+        if (cover_block_mapping[block_id].allocated) {
+            ++cover_blocks_allocated;
+        }
+        else {
+            free_cover_ids.push_back(block_id);
+        }
+    }
+    for (auto block_id = 0u; block_id < hidden_block_mapping.size(); ++block_id) {
+        if (hidden_block_mapping[block_id].allocated) {
             ++hidden_blocks_allocated;
         }
         else {
-            max_cover_id = std::max(max_cover_id, item.first.second + 1);
-            ++cover_blocks_allocated;
+            free_hidden_ids.push_back(block_id);
         }
     }
+    // Already in ascending order, so they are valid min-heaps
     ensure(hidden_blocks_allocated + virtual_list.size() == cover_blocks_allocated, "Buffer::Buffer")
         << "Number of cover blocks (" << cover_blocks_allocated << ") does not equal number of hidden blocks (" << hidden_blocks_allocated + virtual_list.size() << ")";
 
-    ensure(disk.numberOfBlocks() == block_mapping.size() + unallocated_list.size() + virtual_list.size() + number_of_mapping_blocks * 2, "Buffer::unlocked_flush")
+    ensure(disk.numberOfBlocks() == blocksAllocated() + free_blocks + virtual_list.size() + number_of_mapping_blocks * 2, "Buffer::unlocked_flush")
         << "Numbers of types don't add up";
+
+    staging_thread = std::thread([this] { stageDirtyBlocks(); });
+}
+
+struct MappingScanResult {
+    std::vector<std::pair<std::pair<bool, unsigned int>, unsigned int>> mapped;
+    std::vector<unsigned int> virtual_blocks;
+    std::exception_ptr error;
+};
+
+// Branch-free reduction, so that the compiler can vectorise it
+bool all_unassigned(const secure_string& buf) {
+    unsigned char combined = 0xff;
+    for (auto c : buf) {
+        combined &= c;
+    }
+    return combined == 0xff;
+}
+
+void Buffer::readMappingPage(unsigned int mapping_block, std::vector<std::uint32_t>& entries) {
+    secure_string cover_buf(LOGICAL_BLOCK_SIZE, '\0'), hidden_buf(LOGICAL_BLOCK_SIZE, '\xff');
+    disk.readBlock(mapping_block, false, cover_buf);
+    if (!no_hidden) {
+        disk.readBlock(number_of_mapping_blocks + mapping_block, true, hidden_buf);
+    }
+    entries.assign(MAPPING_POINTERS_PER_BLOCK, FREE_MAPPING_ENTRY);
+
+    if (all_unassigned(cover_buf) && all_unassigned(hidden_buf)) {
+        // Fast path for the common case of an entirely free range
+        return;
+    }
+
+    for (auto pos = 0u; pos < MAPPING_POINTERS_PER_BLOCK; ++pos) {
+        auto phy_blk_id = mapping_block * MAPPING_POINTERS_PER_BLOCK + pos;
+        auto log_blk_id = intFromBytes(&cover_buf[BLOCK_POINTER_SIZE * pos]);
+        auto hid_log_blk_id = intFromBytes(&hidden_buf[BLOCK_POINTER_SIZE * pos]);
+        if (phy_blk_id >= totalBlocks()) {
+            ensure(log_blk_id == NO_BLOCK_ASSIGNED && hid_log_blk_id == NO_BLOCK_ASSIGNED, "Buffer::readMappingPage")
+                << "Block mapping set for non-existant block";
+            continue;
+        }
+        ensure(hid_log_blk_id == NO_BLOCK_ASSIGNED || log_blk_id == VIRTUAL_BLOCK, "Buffer::readMappingPage")
+            << "Hidden block not shown in cover block table";
+        ensure((log_blk_id <= MAX_LOGICAL_BLOCK_ID || log_blk_id >= VIRTUAL_BLOCK) && (hid_log_blk_id <= MAX_LOGICAL_BLOCK_ID || hid_log_blk_id == NO_BLOCK_ASSIGNED), "Buffer::readMappingPage")
+            << "Logical block ID out of range";
+
+        if (log_blk_id != VIRTUAL_BLOCK) {
+            entries[pos] = log_blk_id;
+        }
+        else if (hid_log_blk_id != NO_BLOCK_ASSIGNED) {
+            entries[pos] = hid_log_blk_id | HIDDEN_MAPPING_ENTRY;
+        }
+        else {
+            entries[pos] = VIRTUAL_MAPPING_ENTRY;
+        }
+    }
 }
 
 void Buffer::scanEntriesTable() {
     std::lock_guard<std::mutex> lg(lock);
-    secure_string buf(LOGICAL_BLOCK_SIZE, '\0');
-    reverse_block_mapping.resize(totalBlocks());
 
-    // Cover mapping
-    for (auto i = 0u; i < number_of_mapping_blocks; ++i) {
-        disk.readBlock(i, false, buf);
-        for (auto pos = 0u; pos < MAPPING_POINTERS_PER_BLOCK; ++pos) {
-            auto phy_blk_id = i * MAPPING_POINTERS_PER_BLOCK + pos;
-            auto log_blk_id = intFromBytes(&buf[BLOCK_POINTER_SIZE * pos]);
-            if (log_blk_id != NO_BLOCK_ASSIGNED) {
-                ensure(phy_blk_id < totalBlocks(), "Buffer::scanEntriesTable") << "Block mapping set for non-existant block";
-                if (log_blk_id == VIRTUAL_BLOCK) {
-                    reverse_block_mapping[phy_blk_id] = {true, VIRTUAL_BLOCK};
+    // The forward mapping has to be built from the whole table, as the table is indexed by physical
+    // block. The pages themselves are dropped again and only loaded on demand later, so just which
+    // blocks are free is kept.
+    auto num_threads = std::max(1u, std::min(std::thread::hardware_concurrency(), number_of_mapping_blocks));
+    std::vector<MappingScanResult> results(num_threads);
+    auto num_superblocks = (totalBlocks() + 64 * FREE_BITMAP_SUPERBLOCK_WORDS - 1) / (64 * FREE_BITMAP_SUPERBLOCK_WORDS);
+    free_bitmap.assign(num_superblocks * FREE_BITMAP_SUPERBLOCK_WORDS, 0);
+    std::vector<std::thread> threads;
+
+    auto scan_range = [&, this](unsigned int start, unsigned int end, MappingScanResult& result) {
+        std::vector<std::uint32_t> entries;
+        for (auto i = start; i < end; ++i) {
+            readMappingPage(i, entries);
+            auto first_phy_blk_id = i * MAPPING_POINTERS_PER_BLOCK;
+            auto num_entries = std::min(MAPPING_POINTERS_PER_BLOCK, totalBlocks() - first_phy_blk_id);
+
+            for (auto pos = 0u; pos < num_entries; ++pos) {
+                auto [hidden, log_blk_id] = unpackMappingEntry(entries[pos]);
+                if (log_blk_id == NO_BLOCK_ASSIGNED) {
+                    // Pages do not end on word boundaries, so neighbouring threads can share a word
+                    std::atomic_ref(free_bitmap[(first_phy_blk_id + pos) / 64])
+                        .fetch_or(std::uint64_t(1) << (first_phy_blk_id + pos) % 64, std::memory_order_relaxed);
+                }
+                else if (log_blk_id == VIRTUAL_BLOCK) {
+                    result.virtual_blocks.push_back(first_phy_blk_id + pos);
                 }
                 else {
-                    block_mapping[{false, log_blk_id}].physical_block_id = phy_blk_id;
-                    reverse_block_mapping[phy_blk_id] = {false, log_blk_id};
+                    result.mapped.push_back({{hidden, log_blk_id}, first_phy_blk_id + pos});
                 }
             }
-            else if (phy_blk_id < totalBlocks()) {
-                unallocated_list.push_back(phy_blk_id);
-                reverse_block_mapping[phy_blk_id] = {false, NO_BLOCK_ASSIGNED};
-            }
         }
+    };
+
+    for (auto t = 0u; t < num_threads; ++t) {
+        threads.emplace_back([&, t] {
+            try {
+                scan_range(number_of_mapping_blocks * t / num_threads, number_of_mapping_blocks * (t + 1) / num_threads, results[t]);
+            }
+            catch (...) {
+                results[t].error = std::current_exception();
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
     }
 
-    if (!no_hidden) {
-        // Hidden mapping
-        for (auto i = 0u; i < number_of_mapping_blocks; ++i) {
-            disk.readBlock(number_of_mapping_blocks + i, true, buf);
-            for (auto pos = 0u; pos < MAPPING_POINTERS_PER_BLOCK; ++pos) {
-                auto phy_blk_id = i * MAPPING_POINTERS_PER_BLOCK + pos;
-                auto log_blk_id = intFromBytes(&buf[BLOCK_POINTER_SIZE * pos]);
-                if (log_blk_id != NO_BLOCK_ASSIGNED) {
-                    ensure(phy_blk_id < totalBlocks(), "Buffer::scanEntriesTable") << "Block mapping set for non-existant block";
-                    ensure(reverse_block_mapping[phy_blk_id] == std::make_pair(true, VIRTUAL_BLOCK), "Buffer::scanEntriesTable") << "Hidden block not shown in cover block table";
-                    block_mapping[{true, log_blk_id}].physical_block_id = phy_blk_id;
-                    reverse_block_mapping[phy_blk_id] = {true, log_blk_id};
-                }
+    for (auto& result : results) {
+        if (result.error) {
+            std::rethrow_exception(result.error);
+        }
+        for (auto [logical_block_id, phy_blk_id] : result.mapped) {
+            auto& mapping = logical_block_id.first ? hidden_block_mapping : cover_block_mapping;
+            if (logical_block_id.second >= mapping.size()) {
+                mapping.resize(logical_block_id.second + 1);
             }
+            ensure(!mapping[logical_block_id.second].allocated, "Buffer::scanEntriesTable")
+                << "Block " << logical_block_id.second << "/" << logical_block_id.first << " is mapped twice";
+            mapping[logical_block_id.second].physical_block_id = phy_blk_id;
+            mapping[logical_block_id.second].allocated = true;
         }
+        virtual_list.insert(virtual_list.end(), result.virtual_blocks.begin(), result.virtual_blocks.end());
     }
 
-    for (auto i = 0u; i < totalBlocks(); ++i) {
-        if (reverse_block_mapping[i].second == VIRTUAL_BLOCK) {
-            virtual_list.push_back(i);
+    // Build the Fenwick tree in place in O(n)
+    free_blocks_tree.assign(num_superblocks + 1, 0);
+    for (auto i = 0u; i < free_bitmap.size(); ++i) {
+        free_blocks_tree[i / FREE_BITMAP_SUPERBLOCK_WORDS + 1] += std::popcount(free_bitmap[i]);
+        free_blocks += std::popcount(free_bitmap[i]);
+    }
+    for (auto i = 1u; i <= num_superblocks; ++i) {
+        auto parent = i + (i & -i);
+        if (parent <= num_superblocks) {
+            free_blocks_tree[parent] += free_blocks_tree[i];
         }
     }
 }
 
+MappingPage& Buffer::mappingPage(unsigned int mapping_block) {
+    auto& page = mapping_pages[mapping_block];
+    if (page) {
+        if (!page->dirty && !page->in_flight) {
+            clean_mapping_pages.splice(clean_mapping_pages.end(), clean_mapping_pages, page->lru_position);
+        }
+        return *page;
+    }
+
+    // Make room first, so that the page being loaded is never the one evicted
+    evictMappingPages(mapping_cache_size - 1);
+    page = std::make_unique<MappingPage>();
+    readMappingPage(mapping_block, page->entries);
+    page->lru_position = clean_mapping_pages.insert(clean_mapping_pages.end(), mapping_block);
+    ++resident_mapping_pages;
+    return *page;
+}
+
+void Buffer::evictMappingPages(unsigned int limit) {
+    // Dirty pages are not in the LRU list, so they stay resident until they have been written
+    while (resident_mapping_pages > limit && clean_mapping_pages.size()) {
+        mapping_pages[clean_mapping_pages.front()].reset();
+        clean_mapping_pages.pop_front();
+        --resident_mapping_pages;
+    }
+}
+
+void Buffer::setFree(unsigned int phy_blk_id, bool free) {
+    auto& word = free_bitmap[phy_blk_id / 64];
+    auto bit = std::uint64_t(1) << phy_blk_id % 64;
+    if (bool(word & bit) == free) {
+        return;
+    }
+    word ^= bit;
+    int delta = free ? 1 : -1;
+    for (auto i = phy_blk_id / 64 / FREE_BITMAP_SUPERBLOCK_WORDS + 1; i < free_blocks_tree.size(); i += i & -i) {
+        free_blocks_tree[i] += delta;
+    }
+    free_blocks += delta;
+}
+
+bool Buffer::isFree(unsigned int phy_blk_id) {
+    return free_bitmap[phy_blk_id / 64] >> phy_blk_id % 64 & 1;
+}
+
+unsigned int Buffer::randomFreeBlock(CryptoPP::RandomNumberGenerator& rng) {
+    ensure(free_blocks, "Buffer::randomFreeBlock") << "No free blocks";
+
+    // Select the free block of a uniformly random rank: descend the tree to its superblock,
+    // then count through the superblock's words and the bits of the word
+    auto rank = random_below(rng, free_blocks);
+    auto num_superblocks = static_cast<unsigned int>(free_blocks_tree.size() - 1);
+    auto superblock = 0u, step = 1u;
+    while (step * 2 <= num_superblocks) {
+        step *= 2;
+    }
+    for (; step; step /= 2) {
+        if (superblock + step <= num_superblocks && free_blocks_tree[superblock + step] <= rank) {
+            superblock += step;
+            rank -= free_blocks_tree[superblock];
+        }
+    }
+
+    for (auto i = superblock * FREE_BITMAP_SUPERBLOCK_WORDS; i < (superblock + 1) * FREE_BITMAP_SUPERBLOCK_WORDS; ++i) {
+        auto word = free_bitmap[i];
+        auto count = static_cast<unsigned int>(std::popcount(word));
+        if (rank >= count) {
+            rank -= count;
+            continue;
+        }
+        for (; rank; --rank) {
+            word &= word - 1;
+        }
+        return i * 64 + std::countr_zero(word);
+    }
+    throw std::runtime_error("Free block counts are inconsistent with the free block bitmap");
+}
+
+Buffer::~Buffer() {
+    {
+        std::lock_guard<std::mutex> lg(lock);
+        stopping = true;
+    }
+    staging_wanted.notify_all();
+    staging_thread.join();
+    if (flush_thread.joinable()) {
+        flush_thread.join();
+    }
+}
+
+BlockMappingInfo* Buffer::findBlock(std::pair<bool, unsigned int> logical_block_id) {
+    auto& mapping = logical_block_id.first ? hidden_block_mapping : cover_block_mapping;
+    if (logical_block_id.second < mapping.size() && mapping[logical_block_id.second].allocated) {
+        return &mapping[logical_block_id.second];
+    }
+    return nullptr;
+}
+
+BlockMappingInfo& Buffer::blockInfo(std::pair<bool, unsigned int> logical_block_id) {
+    auto block_info = findBlock(logical_block_id);
+    ensure(block_info, "Buffer::blockInfo") << "Block " << logical_block_id.second << "/" << logical_block_id.first << " does not exist";
+    return *block_info;
+}
+
 unsigned int Buffer::totalBlocks() {
     return disk.numberOfBlocks() - number_of_mapping_blocks * 2;
 }
 
 unsigned int Buffer::blocksAllocated() {
-    return block_mapping.size();
+    return cover_blocks_allocated + hidden_blocks_allocated;
 }
 
 unsigned int Buffer::blocksForAspect(bool /*hidden*/) {
@@ -175,78 +438,98 @@ unsigned int Buffer::blocksAllocatedForAspect(bool hidden) {
     return hidden ? hidden_blocks_allocated : cover_blocks_allocated;
 }
 
-BlockAccessor Buffer::block(unsigned int block_id, bool hidden) {
+BlockAccessor Buffer::block(unsigned int block_id, bool hidden, CachePriority priority, AccessMode mode) {
     if (enforce_operations) {
-        std::lock_guard<std::mutex> lg(lock);
         op_requested(block_id, hidden);
     }
 
-    unsigned int cache_location;
-    auto start_time = std::chrono::high_resolution_clock::now();
+    std::unique_lock<std::mutex> lg(lock);
     while (true) {
-        {
-            std::lock_guard<std::mutex> lg(lock);
-
-            auto iter = block_mapping.find({hidden, block_id});
-            ensure(iter != block_mapping.end(), "Buffer::block") << "Block " << block_id << "/" << hidden << " does not exist";
-            auto& block_info = iter->second;
-            if (block_info.cache_location != NO_CACHE_LOC_ASSIGNED) {
-                auto& cache_entry = cache[block_info.cache_location];
-                if (cache_entry.logical_block_id != std::make_pair(hidden, block_id)) {
-                    block_info.cache_location = NO_CACHE_LOC_ASSIGNED;
-                }
+        auto& block_info = blockInfo({hidden, block_id});
+        if (block_info.cache_location != NO_CACHE_LOC_ASSIGNED) {
+            auto& cache_entry = cache[block_info.cache_location];
+            if (cache_entry.logical_block_id != std::make_pair(hidden, block_id)) {
+                block_info.cache_location = NO_CACHE_LOC_ASSIGNED;
             }
-            if (block_info.cache_location == NO_CACHE_LOC_ASSIGNED) {
-                block_info.cache_location = freeCacheEntry();
-                auto& cache_entry = cache[block_info.cache_location];
-                cache_entry.logical_block_id = {hidden, block_id};
-                cache_entry.dirty = false;
-                if (block_info.physical_block_id != NO_BLOCK_ASSIGNED) {
-                    disk.readBlock(block_info.physical_block_id + number_of_mapping_blocks * 2, hidden, cache_entry.data);
+        }
+        if (block_info.cache_location == NO_CACHE_LOC_ASSIGNED) {
+            block_info.cache_location = freeCacheEntry(hidden);
+            auto& cache_entry = cache[block_info.cache_location];
+            cache_entry.logical_block_id = {hidden, block_id};
+            cache_entry.dirty = false;
+            cache_entry.priority = priority;
+            if (block_info.physical_block_id != NO_BLOCK_ASSIGNED) {
+                auto pending = flush_snapshot.locations.find(block_info.physical_block_id);
+                if (pending != flush_snapshot.locations.end()) {
+                    // Still being written by the background flush
+                    std::copy_n(flush_snapshot.writes[pending->second].data.begin(), LOGICAL_BLOCK_SIZE, cache_entry.data);
                 }
                 else {
-                    cache_entry.dirtied_by_current = true;
+                    disk.readBlock(block_info.physical_block_id + number_of_mapping_blocks * 2, hidden, cache_entry.data);
                 }
             }
-            cache_location = block_info.cache_location;
+            else {
+                cache_entry.dirtied_by_current = true;
+            }
         }
 
+        auto cache_location = block_info.cache_location;
         auto& cache_entry = cache[cache_location];
-        cache_entry.lock.lock();
-        {
-            std::lock_guard<std::mutex> lg(lock);
-            if (cache_entry.logical_block_id == std::make_pair(hidden, block_id)) {
-                auto iter = std::find(least_recently_used.begin(), least_recently_used.end(), cache_location);
-                if (iter != least_recently_used.end()) {
-                    least_recently_used.erase(iter);
+        auto shared = mode == AccessMode::SHARED;
+        if (!cache_entry.busy && (shared || !cache_entry.readers)) {
+            if (!cache_entry.readers) {
+                auto& lru = lruFor(hidden, cache_entry.priority);
+                auto iter = std::find(lru.begin(), lru.end(), cache_location);
+                if (iter != lru.end()) {
+                    lru.erase(iter);
                 }
-                return {*this, cache[cache_location]};
             }
-            cache_entry.lock.unlock();
-            auto cur_time = std::chrono::high_resolution_clock::now();
-            using namespace std::chrono_literals;
-            ensure(cur_time - start_time < 10s, "Buffer::block") << "Been waiting for block for > 10s";
+            if (shared) {
+                ++cache_entry.readers;
+            }
+            else {
+                cache_entry.busy = true;
+            }
+            // Once used as metadata, a block stays protected until it is evicted
+            if (priority == CachePriority::METADATA) {
+                cache_entry.priority = priority;
+            }
+            return {*this, cache_entry, shared};
         }
+        // The entry may have been given to another block by the time it is released, so look it up again
+        cache_entry.released.wait(lg);
     }
 }
 
-void Buffer::return_block(BlockCacheEntry& cache_entry) {
+void Buffer::return_block(BlockCacheEntry& cache_entry, bool shared) {
     std::unique_lock<std::mutex> lg(lock);
 
     auto [hidden, block_id] = cache_entry.logical_block_id;
-    auto iter = block_mapping.find(cache_entry.logical_block_id);
-    ensure(iter != block_mapping.end(), "Buffer::return_block") << "Block " << block_id << "/" << hidden << " does not exist";
-    auto& block_info = iter->second;
+    auto& block_info = blockInfo(cache_entry.logical_block_id);
     ensure(block_info.cache_location != NO_CACHE_LOC_ASSIGNED, "Buffer::return_block") << "No cache location for block being returned";
     ensure(&cache_entry == &cache[block_info.cache_location], "Buffer::return_block") << "Cache location of returned block is different";
+    if (shared) {
+        // Nothing can have been written, so the entry just goes back to the LRU (if clean) once the last reader is done
+        if (enforce_operations) {
+            op_released(block_id, hidden, false);
+        }
+        if (!--cache_entry.readers) {
+            if (!cache_entry.dirty) {
+                ensure(!inLRU(block_info.cache_location), "Buffer::return_block")
+                    << "Returned cache entry " << block_info.cache_location << " is already in the LRU cache!";
+                lruFor(hidden, cache_entry.priority).push_back(block_info.cache_location);
+            }
+            cache_entry.released.notify_all();
+        }
+        return;
+    }
     if (!cache_entry.dirty && !cache_entry.dirtied_by_current) {
-        ensure(std::find(least_recently_used.begin(), least_recently_used.end(), block_info.cache_location) == least_recently_used.end(), "Buffer::return_block")
+        ensure(!inLRU(block_info.cache_location), "Buffer::return_block")
             << "Returned cache entry " << block_info.cache_location << " is already in the LRU cache!";
-        least_recently_used.push_back(block_info.cache_location);
+        lruFor(hidden, cache_entry.priority).push_back(block_info.cache_location);
     }
     else if (block_info.physical_block_id != NO_BLOCK_ASSIGNED) {
-        unallocated_list.push_back(block_info.physical_block_id);
-        reverse_block_mapping[block_info.physical_block_id] = {false, NO_BLOCK_ASSIGNED};
+        setReverseMapping(block_info.physical_block_id, {false, NO_BLOCK_ASSIGNED});
         block_info.physical_block_id = NO_BLOCK_ASSIGNED;
     }
     if (enforce_operations) {
@@ -256,68 +539,161 @@ void Buffer::return_block(BlockCacheEntry& cache_entry) {
         hidden ? ++hidden_blocks_changed : ++cover_blocks_changed;
         ensure(hidden_blocks_changed <= cover_blocks_changed, "Buffer::return_block") << "Too many hidden blocks changed";
     }
+    if (cache_entry.dirtied_by_current) {
+        cache_entry.staged.clear();
+        cache_entry.version = ++next_entry_version;
+        staging_pending = true;
+        if (!running_operations) {
+            staging_wanted.notify_one();
+        }
+    }
     cache_entry.dirty = cache_entry.dirty || cache_entry.dirtied_by_current;
     cache_entry.dirtied_by_current = false;
-    cache_entry.lock.unlock();
+    cache_entry.busy = false;
+    cache_entry.released.notify_all();
 }
 
-unsigned int Buffer::freeCacheEntry() {
-    if (least_recently_used.size()) {
-        auto blk_id = least_recently_used.front();
-        least_recently_used.pop_front();
-        ensure(!enforce_operations || reserved_cache_space >= cache.size() - least_recently_used.size(), "Buffer::freeCacheEntry")
-            << "Too much cache space used";
-        return blk_id;
+unsigned int Buffer::freeCacheEntry(bool hidden) {
+    auto cache_location = pickCacheEntry(hidden, false);
+    if (cache_location == NO_CACHE_LOC_ASSIGNED) {
+        // Every entry this aspect may use is dirty or in use, so write some of the dirty ones out rather than fail
+        spillDirtyBlocks();
+        cache_location = pickCacheEntry(hidden, false);
+    }
+    if (cache_location == NO_CACHE_LOC_ASSIGNED) {
+        // Only the quotas are in the way, and an operation which has to go over them beats failing
+        cache_location = pickCacheEntry(hidden, true);
     }
-    throw std::runtime_error("Cache full");
+    if (cache_location == NO_CACHE_LOC_ASSIGNED) {
+        throw std::runtime_error("Cache full");
+    }
+    ++partitions[hidden].entries;
+    ensure(!enforce_operations || reserved_cache_space >= cache.size() - idleCacheEntries(), "Buffer::freeCacheEntry")
+        << "Too much cache space used";
+    return cache_location;
 }
 
-BlockAccessor Buffer::allocateBlock(bool hidden) {
+unsigned int Buffer::pickCacheEntry(bool hidden, bool ignore_quotas) {
+    auto under_quota = ignore_quotas || partitions[hidden].entries < partitionQuota(hidden);
+    if (unused_cache_entries.size() && (under_quota || cache_borrowing)) {
+        auto cache_location = unused_cache_entries.front();
+        unused_cache_entries.pop_front();
+        return cache_location;
+    }
+    // Take back space which the other aspect has borrowed before giving up any of our own
+    if (under_quota && partitions[!hidden].entries > partitionQuota(!hidden)) {
+        auto cache_location = evictCacheEntry(!hidden);
+        if (cache_location != NO_CACHE_LOC_ASSIGNED) {
+            return cache_location;
+        }
+    }
+    auto cache_location = evictCacheEntry(hidden);
+    if (cache_location == NO_CACHE_LOC_ASSIGNED && ignore_quotas) {
+        cache_location = evictCacheEntry(!hidden);
+    }
+    return cache_location;
+}
+
+unsigned int Buffer::evictCacheEntry(bool hidden) {
+    // Metadata is only evicted once it is over its share of the partition, or when there is nothing else
+    auto& partition = partitions[hidden];
+    auto over_share = partition.metadata_least_recently_used.size() > partition.entries / METADATA_CACHE_SHARE;
+    auto& lru = over_share || partition.least_recently_used.empty() ? partition.metadata_least_recently_used : partition.least_recently_used;
+    if (lru.empty()) {
+        return NO_CACHE_LOC_ASSIGNED;
+    }
+    auto cache_location = lru.front();
+    lru.pop_front();
+    // Entries whose block has been deallocated stay in the LRU, but have already left the partition
+    if (cache[cache_location].logical_block_id.second != NO_BLOCK_ASSIGNED) {
+        --partition.entries;
+    }
+    return cache_location;
+}
+
+unsigned int Buffer::partitionQuota(bool hidden) {
+    auto hidden_quota = static_cast<unsigned int>(static_cast<unsigned long>(cache.size()) * hidden_cache_share / 100);
+    return hidden ? hidden_quota : cache.size() - hidden_quota;
+}
+
+unsigned int Buffer::idleCacheEntries() {
+    auto idle = unused_cache_entries.size();
+    for (auto& partition : partitions) {
+        idle += partition.least_recently_used.size() + partition.metadata_least_recently_used.size();
+    }
+    return idle;
+}
+
+std::deque<unsigned int>& Buffer::lruFor(bool hidden, CachePriority priority) {
+    auto& partition = partitions[hidden];
+    return priority == CachePriority::METADATA ? partition.metadata_least_recently_used : partition.least_recently_used;
+}
+
+bool Buffer::inLRU(unsigned int cache_location) {
+    for (auto& partition : partitions) {
+        for (auto lru : {&partition.least_recently_used, &partition.metadata_least_recently_used}) {
+            if (std::find(lru->begin(), lru->end(), cache_location) != lru->end()) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+BlockAccessor Buffer::allocateBlock(bool hidden, CachePriority priority) {
     unsigned int block_id;
     {
         std::lock_guard<std::mutex> lg(lock);
 
         ensure(cover_blocks_allocated + hidden_blocks_allocated < totalBlocks(), "Buffer::allocateBlock") << "FS is full";
         ensure(hidden_blocks_allocated <= cover_blocks_allocated, "Buffer::allocateBlock") << "Too many hidden blocks allocated";
-        block_id = hidden ? max_hidden_id++ : max_cover_id++;
-        block_mapping[{hidden, block_id}] = {};
+        block_id = takeFreeId(hidden);
+        (hidden ? hidden_block_mapping : cover_block_mapping)[block_id].allocated = true;
         if (isDebugging()) {
             std::cout << "Allocated " << block_id << "/" << hidden << std::endl;
         }
         hidden ? ++hidden_blocks_allocated : ++cover_blocks_allocated;
     }
-    auto acc = block(block_id, hidden);
+    auto acc = block(block_id, hidden, priority);
     acc.writable();
     return acc;
 }
 
 void Buffer::deallocateBlock(unsigned int block_id, bool hidden) {
-    std::lock_guard<std::mutex> lg(lock);
+    std::unique_lock<std::mutex> lg(lock);
 
-    auto iter = block_mapping.find({hidden, block_id});
-    ensure(iter != block_mapping.end(), "Buffer::deallocateBlock") << "Block " << block_id << "/" << hidden << " does not exist";
-    auto& block_info = iter->second;
+    auto cache_location = blockInfo({hidden, block_id}).cache_location;
+    if (cache_location != NO_CACHE_LOC_ASSIGNED) {
+        // Wait for the block to be returned, unless its entry has been given to another block meanwhile
+        auto& cache_entry = cache[cache_location];
+        cache_entry.released.wait(lg, [&] {
+            return (!cache_entry.busy && !cache_entry.readers) || cache_entry.logical_block_id != std::make_pair(hidden, block_id);
+        });
+    }
 
+    auto& block_info = blockInfo({hidden, block_id});
     if (block_info.cache_location != NO_CACHE_LOC_ASSIGNED) {
         auto& cache_entry = cache[block_info.cache_location];
         if (cache_entry.logical_block_id == std::make_pair(hidden, block_id)) {
-            std::lock_guard<std::mutex> lg2(cache_entry.lock);
-            ensure(cache_entry.logical_block_id == std::make_pair(hidden, block_id), "Buffer::deallocateBlock") << "Cache entry is not correct";
             cache_entry.logical_block_id = {false, NO_BLOCK_ASSIGNED};
+            --partitions[hidden].entries;
             if (cache_entry.dirty) {
-                least_recently_used.push_back(block_info.cache_location);
+                // A clean entry is already in its partition's LRU, but a dirty one is not in any
+                cache_entry.priority = CachePriority::DATA;
+                unused_cache_entries.push_back(block_info.cache_location);
                 hidden ? --hidden_blocks_changed : --cover_blocks_changed;
                 ensure(hidden_blocks_changed <= cover_blocks_changed, "Buffer::deallocateBlock") << "Too many hidden blocks changed";
             }
             cache_entry.dirty = false;
+            cache_entry.staged.clear();
         }
-        block_info.cache_location = NO_CACHE_LOC_ASSIGNED;
-        if (block_info.physical_block_id != NO_BLOCK_ASSIGNED) {
-            unallocated_list.push_back(block_info.physical_block_id);
-            reverse_block_mapping[block_info.physical_block_id] = {false, NO_BLOCK_ASSIGNED};
-        }
     }
-    block_mapping.erase({hidden, block_id});
+    // A dirty block has already given up its physical block, but a clean or uncached one still holds it
+    if (block_info.physical_block_id != NO_BLOCK_ASSIGNED) {
+        setReverseMapping(block_info.physical_block_id, {false, NO_BLOCK_ASSIGNED});
+    }
+    block_info = {};
+    releaseId(hidden, block_id);
     hidden ? --hidden_blocks_allocated : --cover_blocks_allocated;
     ensure(hidden_blocks_allocated <= cover_blocks_allocated, "Buffer::deallocateBlock") << "Too many hidden blocks deallocated";
     if (isDebugging()) {
@@ -325,12 +701,59 @@ void Buffer::deallocateBlock(unsigned int block_id, bool hidden) {
     }
 }
 
+unsigned int Buffer::takeFreeId(bool hidden) {
+    auto& mapping = hidden ? hidden_block_mapping : cover_block_mapping;
+    auto& free_ids = hidden ? free_hidden_ids : free_cover_ids;
+
+    // The pool may hold IDs past the end of the mapping (after it has been trimmed) or IDs that have since
+    // been handed out again from the end, so skip those
+    while (free_ids.size()) {
+        std::pop_heap(free_ids.begin(), free_ids.end(), std::greater<>());
+        auto block_id = free_ids.back();
+        free_ids.pop_back();
+        if (block_id < mapping.size() && !mapping[block_id].allocated) {
+            return block_id;
+        }
+    }
+    ensure(mapping.size() <= MAX_LOGICAL_BLOCK_ID, "Buffer::takeFreeId") << "Out of logical block IDs";
+    mapping.emplace_back();
+    return mapping.size() - 1;
+}
+
+void Buffer::releaseId(bool hidden, unsigned int block_id) {
+    auto& mapping = hidden ? hidden_block_mapping : cover_block_mapping;
+    auto& free_ids = hidden ? free_hidden_ids : free_cover_ids;
+
+    free_ids.push_back(block_id);
+    std::push_heap(free_ids.begin(), free_ids.end(), std::greater<>());
+
+    // Lower the high-water mark, so that the mapping only covers live IDs
+    auto new_size = mapping.size();
+    while (new_size && !mapping[new_size - 1].allocated) {
+        --new_size;
+    }
+    mapping.resize(new_size);
+
+    if (free_ids.size() > mapping.size()) {
+        std::erase_if(free_ids, [&mapping](auto id) { return id >= mapping.size() || mapping[id].allocated; });
+        std::make_heap(free_ids.begin(), free_ids.end(), std::greater<>());
+    }
+}
+
 void Buffer::flush() {
     std::lock_guard<std::mutex> lg(lock);
     unlocked_flush();
+    finishBackgroundFlush();
+    // The failed writes are kept for the next flush to retry, but the caller asked for them to be on disk now
+    if (flush_error) {
+        std::rethrow_exception(flush_error);
+    }
 }
 
 void Buffer::unlocked_flush() {
+    // Blocks freed by the previous flush may be chosen again, so it must be on disk first
+    finishBackgroundFlush();
+
     std::vector<std::pair<char, unsigned int>> to_flush;
     CryptoPP::AutoSeededRandomPool rng;
     unsigned int num_cover = 0, num_hidden = 0;
@@ -346,15 +769,12 @@ void Buffer::unlocked_flush() {
     ensure(hidden_blocks_changed + cover_blocks_changed == to_flush.size(), "Buffer::unlocked_flush")
         << "Changed stats do not match";
 
-    ensure(hidden_blocks_allocated + cover_blocks_allocated == block_mapping.size(), "Buffer::unlocked_flush")
-        << "Changed stats do not match";
-
-    ensure(disk.numberOfBlocks() == block_mapping.size() - to_flush.size() + unallocated_list.size() + virtual_list.size() + number_of_mapping_blocks * 2, "Buffer::unlocked_flush")
+    ensure(disk.numberOfBlocks() == blocksAllocated() - to_flush.size() + free_blocks + virtual_list.size() + number_of_mapping_blocks * 2, "Buffer::unlocked_flush")
         << "Flush sizes don't add up: "
         << disk.numberOfBlocks() << " total blocks, "
-        << block_mapping.size() << " allocated blocks, "
+        << blocksAllocated() << " allocated blocks, "
         << to_flush.size() << " changed blocks, "
-        << unallocated_list.size() << " unallocated blocks, "
+        << free_blocks << " unallocated blocks, "
         << virtual_list.size() << " virtual blocks and "
         << number_of_mapping_blocks * 2 << " mapping blocks";
 
@@ -365,169 +785,687 @@ void Buffer::unlocked_flush() {
     }
 
     while (hidden_blocks_allocated + virtual_list.size() > cover_blocks_allocated) {
-        auto idx = CryptoPP::Integer(rng, 0, virtual_list.size() - 1).ConvertToLong();
-        auto phy_blk_id = virtual_list[idx];
-        if (reverse_block_mapping[phy_blk_id].second != NO_BLOCK_ASSIGNED) {
-            unallocated_list.push_back(phy_blk_id);
-            reverse_block_mapping[phy_blk_id] = {false, NO_BLOCK_ASSIGNED};
+        auto phy_blk_id = take_random(virtual_list, rng);
+        if (phy_blk_id != NO_BLOCK_ASSIGNED) {
+            setReverseMapping(phy_blk_id, {false, NO_BLOCK_ASSIGNED});
         }
-        virtual_list.erase(virtual_list.begin() + idx);
+    }
+
+    ensure(num_hidden <= num_cover, "Buffer::unlocked_flush") << "Too many hidden blocks changed";
+    std::vector<std::pair<unsigned int, secure_string>> relocated;
+    addChaff(to_flush, relocated, num_cover - num_hidden);
+    pruneFailedWrites();
+    placeFlushWrites(to_flush, relocated);
+
+    snapshotEntriesTable();
+    committing_frees = static_cast<unsigned int>(freed_since_commit.size());
+
+    cover_blocks_changed = hidden_blocks_changed = 0;
+
+    flush_thread_done = false;
+    flush_error = nullptr;
+    flush_thread = std::thread([this] { writeFlushSnapshot(); });
+}
+
+void Buffer::addChaff(std::vector<std::pair<char, unsigned int>>& to_flush, std::vector<std::pair<unsigned int, secure_string>>& relocated, unsigned int num_chaff) {
+    // Hidden side writes which change nothing visible: new virtual blocks for cover blocks allocated since
+    // the last flush, moving virtual blocks, then moving hidden blocks
+    while (num_chaff && hidden_blocks_allocated + virtual_list.size() < cover_blocks_allocated) {
+        virtual_list.push_back(NO_BLOCK_ASSIGNED);
+        to_flush.push_back({'V', virtual_list.size() - 1});
+        --num_chaff;
     }
 
     auto virtual_idx = 0u;
-    while (num_hidden < num_cover) {
+    while (num_chaff && virtual_idx < virtual_list.size()) {
         if (virtual_list[virtual_idx] == NO_BLOCK_ASSIGNED) {
             break;
         }
-        unallocated_list.push_back(virtual_list[virtual_idx]);
-        reverse_block_mapping[virtual_list[virtual_idx]] = {false, NO_BLOCK_ASSIGNED};
+        setReverseMapping(virtual_list[virtual_idx], {false, NO_BLOCK_ASSIGNED});
         virtual_list[virtual_idx] = NO_BLOCK_ASSIGNED;
         to_flush.push_back({'V', virtual_idx});
-        ++num_hidden;
+        --num_chaff;
         ++virtual_idx;
     }
 
-    for (auto bm_iter = block_mapping.begin(); num_hidden < num_cover && bm_iter != block_mapping.end(); ++bm_iter) {
-        if (bm_iter->first.first && bm_iter->second.physical_block_id != NO_BLOCK_ASSIGNED) {
-            unallocated_list.push_back(bm_iter->second.physical_block_id);
-            reverse_block_mapping[bm_iter->second.physical_block_id] = {false, NO_BLOCK_ASSIGNED};
-            to_flush.push_back({'H', bm_iter->first.second});
-            ++num_hidden;
+    // Relocated hidden blocks are read before anything is written, as their old locations are free from now on
+    auto relocate = [&](unsigned int block_id, BlockMappingInfo& block_info, const unsigned char* cached_data) {
+        secure_string data(LOGICAL_BLOCK_SIZE, '\0');
+        auto pending = flush_snapshot.locations.find(block_info.physical_block_id);
+        if (cached_data) {
+            std::copy_n(cached_data, LOGICAL_BLOCK_SIZE, data.begin());
+        }
+        else if (pending != flush_snapshot.locations.end()) {
+            // Kept from a flush which failed, so it may not be on the disk
+            std::copy_n(flush_snapshot.writes[pending->second].data.begin(), LOGICAL_BLOCK_SIZE, data.begin());
+        }
+        else {
+            disk.readBlock(block_info.physical_block_id + number_of_mapping_blocks * 2, true, data);
+        }
+        setReverseMapping(block_info.physical_block_id, {false, NO_BLOCK_ASSIGNED});
+        // Reassigned when placed, and marks the block as taken for the scan below
+        block_info.physical_block_id = NO_BLOCK_ASSIGNED;
+        to_flush.push_back({'H', relocated.size()});
+        relocated.push_back({block_id, std::move(data)});
+        --num_chaff;
+    };
+    // Prefer hidden blocks which are already cached, as they need no read. Entries in use may be being written.
+    for (auto i = 0u; num_chaff && i < cache.size(); ++i) {
+        auto& cache_entry = cache[i];
+        auto [hidden, block_id] = cache_entry.logical_block_id;
+        if (hidden && block_id != NO_BLOCK_ASSIGNED && !cache_entry.dirty && !cache_entry.busy) {
+            auto& block_info = blockInfo(cache_entry.logical_block_id);
+            if (block_info.physical_block_id != NO_BLOCK_ASSIGNED && block_info.cache_location == i) {
+                relocate(block_id, block_info, cache_entry.data);
+            }
+        }
+    }
+    for (auto block_id = 0u; num_chaff && block_id < hidden_block_mapping.size(); ++block_id) {
+        auto& block_info = hidden_block_mapping[block_id];
+        if (block_info.allocated && block_info.physical_block_id != NO_BLOCK_ASSIGNED) {
+            relocate(block_id, block_info, nullptr);
+        }
+    }
+    ensure(!num_chaff, "Buffer::addChaff") << "Could not generate enough changed";
+}
+
+void Buffer::pruneFailedWrites() {
+    // Left by a flush which failed. They are written again, except for those whose block has been freed since,
+    // as it may be chosen again by placeFlushWrites.
+    auto& writes = flush_snapshot.writes;
+    std::vector<PendingWrite> kept;
+    flush_snapshot.locations.clear();
+    for (auto& write : writes) {
+        auto phy_block_id = write.physical_block_id - number_of_mapping_blocks * 2;
+        if (!isFree(phy_block_id)) {
+            if (write.data.size()) {
+                flush_snapshot.locations[phy_block_id] = kept.size();
+            }
+            kept.push_back(std::move(write));
         }
     }
-    ensure(num_hidden == num_cover, "Buffer::unlocked_flush") << "Could not generate enough changed";
+    writes = std::move(kept);
+}
 
-    secure_string buf(LOGICAL_BLOCK_SIZE, '\0');
-    while (to_flush.size()) {
-        auto idx = CryptoPP::Integer(rng, 0, to_flush.size() - 1).ConvertToLong();
-        unsigned int rand = CryptoPP::Integer(rng, 0, unallocated_list.size() - 1).ConvertToLong();
-        auto [mode, cache_idx] = to_flush[idx];
-        auto phy_block_id = unallocated_list[rand];
+void Buffer::placeFlushWrites(std::vector<std::pair<char, unsigned int>>& to_flush, std::vector<std::pair<unsigned int, secure_string>>& relocated) {
+    // Decide every placement and take a copy of the data now, so that the writes can be done in the background
+    CryptoPP::AutoSeededRandomPool rng;
+    auto& writes = flush_snapshot.writes;
+    if (locality > 1) {
+        // Logically adjacent blocks next to each other: cover blocks, then hidden ones, then virtual ones
+        auto order = [&](std::pair<char, unsigned int> item) -> std::pair<unsigned int, unsigned int> {
+            auto [mode, idx] = item;
+            if (mode == 'C') {
+                return cache[idx].logical_block_id;
+            }
+            return mode == 'H' ? std::make_pair(1u, relocated[idx].first) : std::make_pair(2u, idx);
+        };
+        std::sort(to_flush.begin(), to_flush.end(), [&](auto a, auto b) { return order(a) < order(b); });
+    }
+    // Runs start at uniformly random free blocks and carry on into the blocks after while they are free, up to
+    // locality blocks long. Each block is a run of its own by default. The order the writes are decided in gives
+    // nothing else away, as writeFlushSnapshot sorts them by location anyway.
+    unsigned int phy_block_id = 0, run_length = 0;
+    for (auto [mode, cache_idx] : to_flush) {
+        auto next = phy_block_id + 1;
+        if (run_length && run_length < locality && next < totalBlocks() && isFree(next)) {
+            phy_block_id = next;
+            ++run_length;
+        }
+        else {
+            phy_block_id = randomFreeBlock(rng);
+            run_length = 1;
+        }
 
         if (mode == 'C') {
             auto& cache_entry = cache[cache_idx];
-            auto& block_info = block_mapping[cache_entry.logical_block_id];
-
-            ensure(block_info.cache_location == cache_idx, "Buffer::unlocked_flush") << "Block info cache location is wrong";
-            disk.writeBlock(phy_block_id + number_of_mapping_blocks * 2, cache_entry.logical_block_id.first, cache_entry.data);
-            reverse_block_mapping[phy_block_id] = cache_entry.logical_block_id;
+            auto& block_info = blockInfo(cache_entry.logical_block_id);
+
+            ensure(block_info.cache_location == cache_idx, "Buffer::placeFlushWrites") << "Block info cache location is wrong";
+            flush_snapshot.locations[phy_block_id] = writes.size();
+            // The plaintext is kept as well, for reads of the block before it reaches the disk
+            writes.push_back({phy_block_id + number_of_mapping_blocks * 2, cache_entry.logical_block_id.first,
+                              secure_string(cache_entry.data, LOGICAL_BLOCK_SIZE), std::move(cache_entry.staged)});
+            cache_entry.staged.clear();
+            setReverseMapping(phy_block_id, cache_entry.logical_block_id);
             cache_entry.dirty = false;
             block_info.physical_block_id = phy_block_id;
 
-            ensure(std::find(least_recently_used.begin(), least_recently_used.end(), cache_idx) == least_recently_used.end(), "Buffer::unlocked_flush")
+            ensure(!inLRU(cache_idx), "Buffer::placeFlushWrites")
                 << "Returned cache entry " << block_info.cache_location << " is already in the LRU cache!";
-            least_recently_used.push_back(cache_idx);
+            lruFor(cache_entry.logical_block_id.first, cache_entry.priority).push_back(cache_idx);
         }
         else if (mode == 'V') {
-            rng.GenerateBlock(&buf[0], LOGICAL_BLOCK_SIZE);
-            disk.writeBlock(phy_block_id + number_of_mapping_blocks * 2, true, buf);
-            reverse_block_mapping[phy_block_id] = {true, VIRTUAL_BLOCK};
+            writes.push_back({phy_block_id + number_of_mapping_blocks * 2, true, {}});
+            setReverseMapping(phy_block_id, {true, VIRTUAL_BLOCK});
             virtual_list[cache_idx] = phy_block_id;
         }
         else if (mode == 'H') {
-            auto location = std::make_pair(true, cache_idx);
-            auto& block_info = block_mapping[location];
-            disk.readBlock(block_info.physical_block_id + number_of_mapping_blocks * 2, true, buf);
-            disk.writeBlock(phy_block_id + number_of_mapping_blocks * 2, true, buf);
-            reverse_block_mapping[phy_block_id] = {true, cache_idx};
-            block_info.physical_block_id = phy_block_id;
+            auto& [block_id, data] = relocated[cache_idx];
+            flush_snapshot.locations[phy_block_id] = writes.size();
+            writes.push_back({phy_block_id + number_of_mapping_blocks * 2, true, std::move(data)});
+            setReverseMapping(phy_block_id, {true, block_id});
+            blockInfo({true, block_id}).physical_block_id = phy_block_id;
         }
+    }
+    to_flush.clear();
+}
 
-        to_flush.erase(to_flush.begin() + idx);
-        unallocated_list.erase(unallocated_list.begin() + rand);
+void Buffer::spillDirtyBlocks() {
+    // A flush of just some of the dirty blocks which are not in use, to free cache entries in the middle of
+    // operations. The table is left for the next full flush, which writes all of the dirty pages.
+    finishBackgroundFlush();
+
+    // Until then the table on disk may still point at the blocks freed since it was written, and a crash must
+    // find them as they were, so they are taken out of the free blocks while the spill is placed
+    std::vector<unsigned int> withheld;
+    auto withhold = [&] {
+        for (auto phy_blk_id : freed_since_commit) {
+            if (isFree(phy_blk_id)) {
+                setFree(phy_blk_id, false);
+                withheld.push_back(phy_blk_id);
+            }
+        }
+    };
+    auto release_withheld = [&] {
+        for (auto phy_blk_id : withheld) {
+            setFree(phy_blk_id, true);
+        }
+        withheld.clear();
+    };
+
+    std::vector<unsigned int> cover, hidden;
+    for (auto i = 0u; i < cache.size(); ++i) {
+        auto& cache_entry = cache[i];
+        if (cache_entry.logical_block_id.second != NO_BLOCK_ASSIGNED && cache_entry.dirty && !cache_entry.busy && !cache_entry.readers) {
+            (cache_entry.logical_block_id.first ? hidden : cover).push_back(i);
+        }
     }
 
-    writeEntriesTable();
+    // As in a full flush, at most as many hidden blocks as cover blocks are written. The cover changes left
+    // must still cover the hidden changes left, plus any that running operations may yet make.
+    auto hidden_headroom = operation_space - cover_operation_space;
+    auto spare_cover = cover_blocks_changed - hidden_blocks_changed;
+    // Each cover block is matched by a hidden one or chaff, which all need a block which may be written over.
+    // Chaff only frees blocks, so the count holds until the writes are placed.
+    withhold();
+    auto usable_blocks = free_blocks;
+    release_withheld();
+    auto num_hidden = std::min({static_cast<unsigned int>(hidden.size()), static_cast<unsigned int>(cover.size()), SPILL_BLOCKS});
+    auto num_cover = std::min({static_cast<unsigned int>(cover.size()), SPILL_BLOCKS, usable_blocks / 2,
+                               spare_cover + num_hidden > hidden_headroom ? spare_cover + num_hidden - hidden_headroom : 0});
+    num_hidden = std::min(num_hidden, num_cover);
+    if (!num_cover) {
+        throw std::runtime_error("Cache full");
+    }
+    if (isDebugging()) {
+        std::cout << "Spilling " << num_cover << " cover and " << num_hidden << " hidden dirty blocks" << std::endl;
+    }
 
-    cover_blocks_changed = hidden_blocks_changed = 0;
+    std::vector<std::pair<char, unsigned int>> to_flush;
+    for (auto i = 0u; i < num_cover; ++i) {
+        to_flush.push_back({'C', cover[i]});
+    }
+    for (auto i = 0u; i < num_hidden; ++i) {
+        to_flush.push_back({'C', hidden[i]});
+    }
+    std::vector<std::pair<unsigned int, secure_string>> relocated;
+    addChaff(to_flush, relocated, num_cover - num_hidden);
+    pruneFailedWrites();
+    // Including the old locations of the hidden blocks moved as chaff
+    withhold();
+    placeFlushWrites(to_flush, relocated);
+    release_withheld();
+
+    cover_blocks_changed -= num_cover;
+    hidden_blocks_changed -= num_hidden;
+
+    flush_thread_done = false;
+    flush_error = nullptr;
+    flush_thread = std::thread([this] { writeFlushSnapshot(); });
 }
 
-void Buffer::writeEntriesTable() {
-    secure_string buf(LOGICAL_BLOCK_SIZE, '\0');
-
-    // Cover mapping
-    for (auto i = 0u; i < number_of_mapping_blocks; ++i) {
-        buf.replace(0, LOGICAL_BLOCK_SIZE, LOGICAL_BLOCK_SIZE, '\xff');
-        for (auto pos = 0u; pos < MAPPING_POINTERS_PER_BLOCK; ++pos) {
-            auto phy_blk_id = i * MAPPING_POINTERS_PER_BLOCK + pos;
-            if (phy_blk_id >= totalBlocks()) {
-                break;
+void Buffer::writeFlushSnapshot() {
+    // Runs without Buffer::lock: the snapshot is not modified until the thread has been joined
+    try {
+        CryptoPP::AutoSeededRandomPool rng;
+        // Blocks are written in order of location, and runs of adjacent ones with a single write
+        secure_string run, ciphertext(PHYSICAL_BLOCK_SIZE, '\0');
+        unsigned int run_start = 0;
+        auto write_run = [&] {
+            if (run.size()) {
+                disk.writeRawBlocks(run_start, run);
+                run.clear();
+            }
+        };
+        auto add_to_run = [&](unsigned int location, const secure_string& block) {
+            auto run_length = run.size() / PHYSICAL_BLOCK_SIZE;
+            if (run_length && (location != run_start + run_length || run_length == MAX_COALESCED_WRITE_BLOCKS)) {
+                write_run();
             }
-            if (reverse_block_mapping[phy_blk_id].first) {
-                intToBytes(&buf[BLOCK_POINTER_SIZE * pos], VIRTUAL_BLOCK);
+            if (run.empty()) {
+                run_start = location;
+            }
+            run.append(block);
+        };
+
+        std::vector<unsigned int> order(flush_snapshot.writes.size());
+        std::iota(order.begin(), order.end(), 0u);
+        std::sort(order.begin(), order.end(), [this](auto a, auto b) {
+            return flush_snapshot.writes[a].physical_block_id < flush_snapshot.writes[b].physical_block_id;
+        });
+        for (auto i : order) {
+            auto& write = flush_snapshot.writes[i];
+            if (write.data.empty()) {
+                // Ciphertext is indistinguishable from random, so virtual blocks skip the cipher entirely
+                if (chaff_pool.empty()) {
+                    chaff_pool.emplace_back(PHYSICAL_BLOCK_SIZE, '\0');
+                    rng.GenerateBlock(&chaff_pool.back()[0], PHYSICAL_BLOCK_SIZE);
+                }
+                add_to_run(write.physical_block_id, chaff_pool.back());
+                chaff_pool.pop_back();
+            }
+            else if (write.ciphertext.size()) {
+                add_to_run(write.physical_block_id, write.ciphertext);
             }
             else {
-                intToBytes(&buf[BLOCK_POINTER_SIZE * pos], reverse_block_mapping[phy_blk_id].second);
+                disk.encryptBlock(&write.data[0], ciphertext, write.hidden);
+                add_to_run(write.physical_block_id, ciphertext);
             }
         }
-        disk.writeBlock(i, false, buf);
+        write_run();
+
+        // The table goes last, so that it never points at data which has not been written
+        // In order of location already (see snapshotEntriesTable)
+        auto& mapping_writes = flush_snapshot.mapping_writes;
+        for (auto& mapping_write : mapping_writes) {
+            disk.encryptBlock(&mapping_write.cover_data[0], ciphertext, false);
+            add_to_run(mapping_write.mapping_block, ciphertext);
+        }
+        for (auto& mapping_write : mapping_writes) {
+            disk.encryptBlock(&mapping_write.hidden_data[0], ciphertext, true);
+            add_to_run(number_of_mapping_blocks + mapping_write.mapping_block, ciphertext);
+        }
+        write_run();
+
+        // Refill the pool while nothing is waiting on us, so that the next flush has its chaff ready
+        while (chaff_pool.size() < CHAFF_POOL_SIZE) {
+            chaff_pool.emplace_back(PHYSICAL_BLOCK_SIZE, '\0');
+            rng.GenerateBlock(&chaff_pool.back()[0], PHYSICAL_BLOCK_SIZE);
+        }
+    }
+    catch (...) {
+        flush_error = std::current_exception();
     }
+    flush_thread_done = true;
+}
+
+void Buffer::finishBackgroundFlush() {
+    if (!flush_thread.joinable()) {
+        return;
+    }
+    flush_thread.join();
+
+    for (auto& mapping_write : flush_snapshot.mapping_writes) {
+        auto& page = *mapping_pages[mapping_write.mapping_block];
+        page.in_flight = false;
+        if (flush_error) {
+            // May not have been written, so it has to be written again
+            page.dirty = true;
+        }
+        else if (!page.dirty) {
+            page.lru_position = clean_mapping_pages.insert(clean_mapping_pages.end(), mapping_write.mapping_block);
+        }
+    }
+
+    if (flush_error) {
+        // None of the data can be relied on to have reached the disk, so the writes are kept, for reads to find
+        // and for the next flush to retry. The error is left for Buffer::flush, rather than thrown at whichever
+        // operation happens to come next.
+        flush_snapshot.mapping_writes.clear();
+        committing_frees = 0;
+        if (isDebugging()) {
+            std::cout << "Background flush failed, keeping " << flush_snapshot.writes.size() << " writes to retry" << std::endl;
+        }
+        return;
+    }
+    flush_snapshot = {};
+    evictMappingPages(mapping_cache_size);
+    // The table on disk has caught up with the blocks freed before it was snapshotted
+    freed_since_commit.erase(freed_since_commit.begin(), freed_since_commit.begin() + committing_frees);
+    committing_frees = 0;
+}
+
+void Buffer::stageDirtyBlocks() {
+    // Encrypts dirty entries once no operations have run for a while, so that the flush mostly just writes
+    // them out. The data is copied under the lock and encrypted without it, and the ciphertext is thrown
+    // away if the entry has changed by the time it is ready.
+    std::unique_lock<std::mutex> lg(lock);
+    secure_string plaintext(LOGICAL_BLOCK_SIZE, '\0');
+    while (!stopping) {
+        if (!staging_pending || running_operations) {
+            staging_wanted.wait(lg);
+            continue;
+        }
+        if (staging_wanted.wait_for(lg, std::chrono::milliseconds(PRE_ENCRYPTION_DELAY), [this] { return stopping || running_operations; })) {
+            continue;
+        }
+
+        auto cache_location = nextStagingCandidate();
+        while (cache_location != NO_CACHE_LOC_ASSIGNED && !stopping && !running_operations) {
+            auto& cache_entry = cache[cache_location];
+            auto version = cache_entry.version;
+            auto hidden = cache_entry.logical_block_id.first;
+            std::copy_n(cache_entry.data, LOGICAL_BLOCK_SIZE, plaintext.begin());
+            lg.unlock();
+
+            secure_string ciphertext(PHYSICAL_BLOCK_SIZE, '\0');
+            disk.encryptBlock(&plaintext[0], ciphertext, hidden);
+
+            lg.lock();
+            // The cache may have shrunk, and the entry may have been written, flushed or reused meanwhile
+            if (cache_location < cache.size() && cache[cache_location].version == version && cache[cache_location].dirty) {
+                cache[cache_location].staged = std::move(ciphertext);
+            }
+            cache_location = nextStagingCandidate();
+        }
+        if (cache_location == NO_CACHE_LOC_ASSIGNED) {
+            staging_pending = false;
+        }
+    }
+}
+
+unsigned int Buffer::nextStagingCandidate() {
+    // Carries on from where the last search stopped, so that a pass over the cache finds each entry once
+    for (auto i = 0u; i < cache.size(); ++i) {
+        auto cache_location = (staging_cursor + i) % cache.size();
+        auto& cache_entry = cache[cache_location];
+        if (cache_entry.logical_block_id.second != NO_BLOCK_ASSIGNED && cache_entry.dirty && !cache_entry.busy && cache_entry.staged.empty()) {
+            staging_cursor = cache_location + 1;
+            return cache_location;
+        }
+    }
+    return NO_CACHE_LOC_ASSIGNED;
+}
+
+void Buffer::setReverseMapping(unsigned int phy_blk_id, std::pair<bool, unsigned int> logical_block_id) {
+    auto mapping_block = phy_blk_id / MAPPING_POINTERS_PER_BLOCK;
+    auto& page = mappingPage(mapping_block);
+    auto& entry = page.entries[phy_blk_id % MAPPING_POINTERS_PER_BLOCK];
+    if (logical_block_id.second == NO_BLOCK_ASSIGNED && !isFree(phy_blk_id)) {
+        freed_since_commit.push_back(phy_blk_id);
+    }
+    setFree(phy_blk_id, logical_block_id.second == NO_BLOCK_ASSIGNED);
+    entry = packMappingEntry(logical_block_id);
+    if (!page.dirty) {
+        if (!page.in_flight) {
+            clean_mapping_pages.erase(page.lru_position);
+        }
+        page.dirty = true;
+    }
+}
+
+void Buffer::snapshotEntriesTable() {
+    CryptoPP::AutoSeededRandomPool rng;
+    std::vector<unsigned int> to_write, clean;
 
-    // Hidden mapping
     for (auto i = 0u; i < number_of_mapping_blocks; ++i) {
-        buf.replace(0, LOGICAL_BLOCK_SIZE, LOGICAL_BLOCK_SIZE, '\xff');
-        for (auto pos = 0u; pos < MAPPING_POINTERS_PER_BLOCK; ++pos) {
-            auto phy_blk_id = i * MAPPING_POINTERS_PER_BLOCK + pos;
-            if (phy_blk_id >= totalBlocks()) {
-                break;
+        (mapping_pages[i] && mapping_pages[i]->dirty ? to_write : clean).push_back(i);
+    }
+
+    // Rewrite an equal number of unchanged table blocks, so that a rewrite without a visible
+    // change is routine and does not indicate a change in the other aspect's table
+    auto num_changed = to_write.size();
+    for (auto i = 0u; i < num_changed && clean.size(); ++i) {
+        to_write.push_back(take_random(clean, rng));
+    }
+    std::sort(to_write.begin(), to_write.end());
+
+    for (auto i : to_write) {
+        auto& page = mappingPage(i);
+        PendingMappingWrite mapping_write{i, secure_string(LOGICAL_BLOCK_SIZE, '\xff'), secure_string(LOGICAL_BLOCK_SIZE, '\xff')};
+        encodeMappingBlock(i, page, mapping_write.cover_data, mapping_write.hidden_data);
+        flush_snapshot.mapping_writes.push_back(std::move(mapping_write));
+
+        // Pinned until written, as reloading it from disk before then would give the old table
+        if (!page.dirty) {
+            clean_mapping_pages.erase(page.lru_position);
+        }
+        page.dirty = false;
+        page.in_flight = true;
+    }
+}
+
+void Buffer::encodeMappingBlock(unsigned int i, const MappingPage& page, secure_string& cover_buf, secure_string& hidden_buf) {
+    // Both tables are always written for the same range, so which hidden table blocks
+    // are rewritten never depends on anything but the cover table
+    auto& entries = page.entries;
+    auto num_entries = std::min(MAPPING_POINTERS_PER_BLOCK, totalBlocks() - i * MAPPING_POINTERS_PER_BLOCK);
+
+    // Branch-free, so that the compiler can vectorise it. Hidden entries show as virtual in the
+    // cover table, and the hidden table only has hidden entries.
+    for (auto pos = 0u; pos < num_entries; ++pos) {
+        auto entry = entries[pos];
+        auto is_hidden = entry >= HIDDEN_MAPPING_ENTRY && entry < VIRTUAL_MAPPING_ENTRY;
+        intToBytes(&cover_buf[BLOCK_POINTER_SIZE * pos], is_hidden ? VIRTUAL_BLOCK : entry);
+        intToBytes(&hidden_buf[BLOCK_POINTER_SIZE * pos], is_hidden ? entry & ~HIDDEN_MAPPING_ENTRY : NO_BLOCK_ASSIGNED);
+    }
+}
+
+BufferOperation Buffer::operation(unsigned int worst_case_blocks, OperationType type, unsigned int data_blocks) {
+    std::unique_lock<std::mutex> lg(lock);
+    // The worst case assumes the tallest trees, so reserve for the trees which actually exist instead. Operations
+    // which turn out to need more grow their reservation in op_requested.
+    auto max_blocks = estimateBlocks(type, worst_case_blocks, data_blocks);
+    auto interactive = isInteractive(type);
+    if (interactive) {
+        ++waiting_interactive_operations;
+    }
+    // Queue up, so that a big operation cannot be overtaken for ever by a stream of smaller ones
+    auto ticket = next_admission_ticket++;
+    admission_queue.push_back(ticket);
+    try {
+        while (true) {
+            if (flush_thread_done && flush_thread.joinable()) {
+                finishBackgroundFlush();
             }
-            if (reverse_block_mapping[phy_blk_id].first && reverse_block_mapping[phy_blk_id].second != VIRTUAL_BLOCK) {
-                intToBytes(&buf[BLOCK_POINTER_SIZE * pos], reverse_block_mapping[phy_blk_id].second);
+            if (memory_pressure.exchange(false)) {
+                target_cache_size = std::max(std::min(target_cache_size, static_cast<unsigned int>(cache.size())) / 2, MIN_CACHE_SIZE);
+            }
+            if (target_cache_size > cache.size()) {
+                growCache();
+            }
+
+            // Bulk operations leave some of the cache free, so that metadata operations do not have to wait
+            // for them to finish and a flush to fit in. An operation bigger than its limit gets all of it, and
+            // relies on spilling dirty blocks.
+            auto limit = static_cast<unsigned int>(interactive ? cache.size() : cache.size() - cache.size() / INTERACTIVE_CACHE_HEADROOM);
+            max_blocks = std::min(max_blocks, limit);
+            // Metadata operations may also start while a flush waits for the running operations, a bounded
+            // number of times so that they cannot hold it off for ever
+            auto held_by_flush = thread_is_waiting_to_flush && (!interactive || interactive_admissions_while_flushing >= MAX_INTERACTIVE_ADMISSIONS_WHILE_FLUSHING);
+            // Operations may overtake the head of the queue, metadata operations before the rest, until it has
+            // been overtaken MAX_ADMISSION_BYPASSES times. Then nothing else starts until it has.
+            auto head_is_due = head_bypasses >= MAX_ADMISSION_BYPASSES;
+            auto at_head = admission_queue.front() == ticket;
+            auto out_of_turn = (head_is_due && !at_head) || (!interactive && waiting_interactive_operations && !(head_is_due && at_head));
+            if (reserved_cache_space + max_blocks <= limit && !held_by_flush && !out_of_turn && target_cache_size >= cache.size()) {
+                reserved_cache_space += max_blocks;
+                operation_space += max_blocks;
+                ++running_operations;
+                if (thread_is_waiting_to_flush) {
+                    ++interactive_admissions_while_flushing;
+                }
+                leaveAdmissionQueue(ticket, interactive, true);
+                if (isDebugging()) {
+                    std::cout << "OPERATION begin by " << std::this_thread::get_id() << " requesting " << max_blocks << " blocks of cache space; " << running_operations << " operations ongoing" << std::endl;
+                }
+                return {*this, max_blocks, worst_case_blocks};
+            }
+            else if (out_of_turn) {
+                admission_changed.wait(lg);
+            }
+            else if (thread_is_waiting_to_flush) {
+                flush_done.wait(lg, [this] { return !thread_is_waiting_to_flush; });
+            }
+            else {
+                thread_is_waiting_to_flush = true;
+                ops_done.wait(lg, [this] { return !running_operations; });
+                try {
+                    unlocked_flush();
+                    if (target_cache_size < cache.size()) {
+                        shrinkCache();
+                    }
+                }
+                catch (...) {
+                    // Let the waiting threads retry rather than wait forever
+                    thread_is_waiting_to_flush = false;
+                    flush_done.notify_all();
+                    throw;
+                }
+                thread_is_waiting_to_flush = false;
+                interactive_admissions_while_flushing = 0;
+                reserved_cache_space = 0;
+                flush_done.notify_all();
             }
         }
-        disk.writeBlock(number_of_mapping_blocks + i, true, buf);
+    }
+    catch (...) {
+        leaveAdmissionQueue(ticket, interactive, false);
+        throw;
     }
 }
 
-BufferOperation Buffer::operation(unsigned int max_blocks) {
-    auto id = std::this_thread::get_id();
+unsigned int Buffer::estimateBlocks(OperationType type, unsigned int worst_case_blocks, unsigned int data_blocks) {
+    // Walking a directory holds its header, the nodes down to a leaf and the entry found, and changing one may
+    // split or merge a node on each level. Reaching a file's blocks holds the nodes down its block tree, and each
+    // block written is held to the end, with a new tree node for every NUM_TREE_BLOCK_TREE_ENTRIES of them.
+    auto dir_walk = tallest_dir + 2, dir_change = tallest_dir + 2, tree_walk = deepest_tree + 1;
+    auto written = data_blocks + data_blocks / NUM_TREE_BLOCK_TREE_ENTRIES + 1;
+    unsigned int estimate;
+    switch (type) {
+        case OperationType::LOOKUP:
+            estimate = dir_walk;
+            break;
+        case OperationType::READ:
+        case OperationType::TRUNCATE:
+            estimate = dir_walk + tree_walk + 1;
+            break;
+        case OperationType::WRITE:
+            estimate = dir_walk + tree_walk + written;
+            break;
+        case OperationType::CREATE:
+            estimate = dir_walk + dir_change + 1;
+            break;
+        case OperationType::REMOVE:
+            estimate = dir_walk + dir_change + tree_walk + 1;
+            break;
+        case OperationType::RENAME:
+            estimate = 2 * (dir_walk + dir_change) + tree_walk + 1;
+            break;
+        default:
+            // Nothing is known about what it does
+            return worst_case_blocks;
+    }
+    return std::min(worst_case_blocks, estimate + OPERATION_RESERVATION_SLACK);
+}
 
-    lock.lock();
-    while (true) {
-        if (reserved_cache_space + max_blocks <= cache.size() && !thread_is_waiting_to_flush) {
-            reserved_cache_space += max_blocks;
-            operation_for_thread[id] = {max_blocks};
-            if (isDebugging()) {
-                std::cout << "OPERATION begin by " << id << " requesting " << max_blocks << " blocks of cache space; " << operation_for_thread.size() << " operations ongoing" << std::endl;
-            }
-            lock.unlock();
-            return {*this};
-        }
-        else if (thread_is_waiting_to_flush) {
-            // wait for flush to end
-            ++waiting_for_flush_to_finish;
-            lock.unlock();
-            wait_for_flush_done.lock();
-            // Baton passing style: mutex passed to us.
-            --waiting_for_flush_to_finish;
-            if (waiting_for_flush_to_finish) {
-                wait_for_flush_done.unlock();
+void Buffer::noteDirHeight(unsigned int height) {
+    raise_to(tallest_dir, height);
+}
+
+void Buffer::noteTreeDepth(unsigned int depth) {
+    raise_to(deepest_tree, depth);
+}
+
+void Buffer::leaveAdmissionQueue(unsigned long ticket, bool interactive, bool admitted) {
+    if (admission_queue.front() == ticket) {
+        head_bypasses = 0;
+    }
+    else if (admitted) {
+        ++head_bypasses;
+    }
+    admission_queue.erase(std::find(admission_queue.begin(), admission_queue.end(), ticket));
+    if (interactive) {
+        --waiting_interactive_operations;
+    }
+    admission_changed.notify_all();
+}
+
+unsigned int Buffer::cacheSize() {
+    std::lock_guard<std::mutex> lg(lock);
+    return cache.size();
+}
+
+void Buffer::resizeCache(unsigned int cache_size) {
+    {
+        std::lock_guard<std::mutex> lg(lock);
+        target_cache_size = std::min(std::max(cache_size, MIN_CACHE_SIZE), slab.maxSlots());
+    }
+    // The resize is applied on admission, which drains the other operations first when shrinking
+    auto op = operation(0);
+}
+
+void Buffer::signalMemoryPressure() {
+    // Only sets a flag, so that it is safe to call from a signal handler
+    memory_pressure = true;
+}
+
+void Buffer::growCache() {
+    slab.resize(target_cache_size);
+    for (auto i = cache.size(); i < target_cache_size; ++i) {
+        cache.emplace_back(slab.slot(i));
+        unused_cache_entries.push_back(i);
+    }
+    if (isDebugging()) {
+        std::cout << "Cache grown to " << cache.size() << " blocks" << std::endl;
+    }
+}
+
+void Buffer::shrinkCache() {
+    // Only called with no operations running and just after a flush, so every entry is clean and unlocked
+    for (auto mapping : {&cover_block_mapping, &hidden_block_mapping}) {
+        for (auto& block_info : *mapping) {
+            if (block_info.cache_location != NO_CACHE_LOC_ASSIGNED && block_info.cache_location >= target_cache_size) {
+                block_info.cache_location = NO_CACHE_LOC_ASSIGNED;
             }
         }
-        else {
-            thread_is_waiting_to_flush = true;
-            if (operation_for_thread.size()) {
-                lock.unlock();
-                wait_for_ops_done.lock();
-                // Baton passing style: mutex passed to us.
-            }
-            unlocked_flush();
-            thread_is_waiting_to_flush = false;
-            reserved_cache_space = 0;
-            if (waiting_for_flush_to_finish) {
-                wait_for_flush_done.unlock();
-            }
+    }
+    auto remove_dropped = [this](std::deque<unsigned int>& lru) {
+        lru.erase(std::remove_if(lru.begin(), lru.end(), [this](auto cache_location) {
+            return cache_location >= target_cache_size;
+        }), lru.end());
+    };
+    remove_dropped(unused_cache_entries);
+    for (auto& partition : partitions) {
+        remove_dropped(partition.least_recently_used);
+        remove_dropped(partition.metadata_least_recently_used);
+        partition.entries = 0;
+    }
+    while (cache.size() > target_cache_size) {
+        cache.pop_back();
+    }
+    slab.resize(cache.size());
+    for (auto& cache_entry : cache) {
+        if (cache_entry.logical_block_id.second != NO_BLOCK_ASSIGNED) {
+            ++partitions[cache_entry.logical_block_id.first].entries;
         }
     }
+    ensure(idleCacheEntries() == cache.size(), "Buffer::shrinkCache") << "Cache entries in use while shrinking";
+    if (isDebugging()) {
+        std::cout << "Cache shrunk to " << cache.size() << " blocks" << std::endl;
+    }
 }
 
-void Buffer::end_operation() {
+void Buffer::end_operation(BufferOperationData& data) {
     std::lock_guard<std::mutex> lg(lock);
-    auto id = std::this_thread::get_id();
-    auto& data = operation_for_thread[id];
     reserved_cache_space -= data.max_blocks - data.blocks.size();
+    operation_space -= data.max_blocks;
+    if (data.hidden == 0) {
+        cover_operation_space -= data.max_blocks;
+    }
     if (isDebugging()) {
-        std::cout << "OPERATION ended by " << id << "; max usage " << data.max_cache_takeup << " (max predicted " << data.max_blocks << "), "
+        std::cout << "OPERATION ended by " << std::this_thread::get_id() << "; max usage " << data.max_cache_takeup << " (max predicted " << data.max_blocks << "), "
             << data.block_requests << " requests, "
             << data.block_writes << " writes." << std::endl;
 
@@ -535,25 +1473,29 @@ void Buffer::end_operation() {
             << "Hidden Alloc = " << hidden_blocks_allocated << ", Cover Alloc = " << cover_blocks_allocated
             << ", Hidden Changed = " << hidden_blocks_changed << ", Cover Changed = " << cover_blocks_changed << std::endl;
     }
-    operation_for_thread.erase(id);
-    if (thread_is_waiting_to_flush && !operation_for_thread.size()) {
-        wait_for_ops_done.unlock();
+    --running_operations;
+    if (thread_is_waiting_to_flush && !running_operations) {
+        ops_done.notify_one();
+    }
+    if (staging_pending && !running_operations) {
+        staging_wanted.notify_one();
     }
 }
 
 BufferOperationData& Buffer::current_operation() {
-    auto id = std::this_thread::get_id();
-    auto iter = operation_for_thread.find(id);
-    ensure(iter != operation_for_thread.end(), "Buffer::current_operation") << "No operation for current thread " << id;
-    return iter->second;
+    ensure(current_operation_data, "Buffer::current_operation") << "No operation for current thread " << std::this_thread::get_id();
+    return *current_operation_data;
 }
 
-BufferOperation::BufferOperation(Buffer& buf) :
-        buffer(buf) {
+BufferOperation::BufferOperation(Buffer& buf, unsigned int max_blocks, unsigned int worst_case_blocks) :
+        buffer(buf), data{max_blocks, worst_case_blocks} {
+    data.blocks.reserve(worst_case_blocks);
+    current_operation_data = &data;
 }
 
 BufferOperation::~BufferOperation() {
-    buffer.end_operation();
+    current_operation_data = nullptr;
+    buffer.end_operation(data);
 }
 
 void Buffer::op_requested(unsigned int block_id, bool hid) {
@@ -561,19 +1503,60 @@ void Buffer::op_requested(unsigned int block_id, bool hid) {
     if (data.hidden != 2) {
         ensure(data.hidden == hid, "BufferOperation::requested") << "Requested block is in a different aspect from the previous one";
     }
+    else if (!hid) {
+        std::lock_guard<std::mutex> lg(lock);
+        cover_operation_space += data.max_blocks;
+    }
     data.hidden = hid;
-    data.blocks.insert(block_id);
     ++data.block_requests;
+    auto iter = std::lower_bound(data.blocks.begin(), data.blocks.end(), block_id);
+    if (iter != data.blocks.end() && *iter == block_id) {
+        return;
+    }
+    ensure(data.blocks.size() < data.worst_case_blocks, "BufferOperation::requested") << "Too many blocks requested";
+    if (data.blocks.size() >= data.max_blocks) {
+        // Estimate was too low, so fall back towards the worst case one block at a time. The reservation may only
+        // grow into cache space which nobody has reserved. If there is none, dirty blocks are written out, and those
+        // which were this operation's or finished operations' then no longer take up any.
+        std::lock_guard<std::mutex> lg(lock);
+        if (reserved_cache_space >= cache.size()) {
+            spillDirtyBlocks();
+            std::erase_if(data.blocks, [&](auto held_block_id) {
+                auto block_info = findBlock({hid, held_block_id});
+                if (!block_info || block_info->cache_location == NO_CACHE_LOC_ASSIGNED) {
+                    return true;
+                }
+                auto& cache_entry = cache[block_info->cache_location];
+                return cache_entry.logical_block_id != std::make_pair(hid, held_block_id)
+                    || (!cache_entry.dirty && !cache_entry.busy && !cache_entry.readers);
+            });
+            iter = std::lower_bound(data.blocks.begin(), data.blocks.end(), block_id);
+            auto dirty = std::count_if(cache.begin(), cache.end(), [](const BlockCacheEntry& cache_entry) { return cache_entry.dirty; });
+            reserved_cache_space = std::min(reserved_cache_space, operation_space + static_cast<unsigned int>(dirty));
+        }
+        if (data.blocks.size() >= data.max_blocks) {
+            if (reserved_cache_space >= cache.size()) {
+                throw std::runtime_error("Cache full");
+            }
+            ++data.max_blocks;
+            ++reserved_cache_space;
+            ++operation_space;
+            if (!data.hidden) {
+                ++cover_operation_space;
+            }
+        }
+    }
+    data.blocks.insert(iter, block_id);
     data.max_cache_takeup = std::max(data.max_cache_takeup, static_cast<unsigned int>(data.blocks.size()));
-    ensure(data.blocks.size() <= data.max_blocks, "BufferOperation::requested") << "Too many blocks requested";
 }
 
 void Buffer::op_released(unsigned int block_id, bool hid, bool dirty) {
     auto& data = current_operation();
     ensure(data.hidden == hid, "BufferOperation::released") << "Released block wasn't requested (hidden deviation)";
-    ensure(data.blocks.count(block_id), "BufferOperation::released") << "Released block wasn't requested (block_id deviation)";
+    auto iter = std::lower_bound(data.blocks.begin(), data.blocks.end(), block_id);
+    ensure(iter != data.blocks.end() && *iter == block_id, "BufferOperation::released") << "Released block wasn't requested (block_id deviation)";
     if (!dirty) {
-        data.blocks.erase(block_id);
+        data.blocks.erase(iter);
     }
     else {
         ++data.block_writes;
@@ -607,3 +1590,100 @@ bool Buffer::allowed(bool hidden, unsigned int allocated, unsigned int changed,
 
     return after_hidden_blocks_allocated <= after_cover_blocks_allocated && after_hidden_blocks_changed <= after_cover_blocks_changed;
 }
+
+std::vector<unsigned int> Buffer::hotBlocks(bool hidden, unsigned int limit) {
+    // Most recently used first, and metadata first of all, as every lookup goes through it. Dirty blocks
+    // have just been written, so they count as recent.
+    std::lock_guard<std::mutex> lg(lock);
+    // How many blocks the cover aspect has cached depends on how much the hidden aspect is using, so both lists
+    // are cut to what the cover share of the cache would be by default, whatever the share and borrowing are
+    limit = std::min(limit, static_cast<unsigned int>(static_cast<unsigned long>(cache.size()) * (100 - DEFAULT_HIDDEN_CACHE_SHARE) / 100));
+    std::vector<unsigned int> block_ids;
+    auto add = [&](const BlockCacheEntry& cache_entry) {
+        if (block_ids.size() < limit && cache_entry.logical_block_id.second != NO_BLOCK_ASSIGNED) {
+            block_ids.push_back(cache_entry.logical_block_id.second);
+        }
+    };
+    auto& partition = partitions[hidden];
+    for (auto iter = partition.metadata_least_recently_used.rbegin(); iter != partition.metadata_least_recently_used.rend(); ++iter) {
+        add(cache[*iter]);
+    }
+    for (auto& cache_entry : cache) {
+        if (cache_entry.dirty && cache_entry.logical_block_id.first == hidden) {
+            add(cache_entry);
+        }
+    }
+    for (auto iter = partition.least_recently_used.rbegin(); iter != partition.least_recently_used.rend(); ++iter) {
+        add(cache[*iter]);
+    }
+    return block_ids;
+}
+
+void Buffer::prefetch(const std::vector<unsigned int>& block_ids, bool hidden) {
+    // Fills unused cache entries, within the aspect's share, PREFETCH_BATCH blocks at a time in physical order
+    // so that adjacent blocks are read together. The entries go to the cold end of the LRU, so that blocks
+    // used since the mount are kept over them.
+    auto is_cached = [this, hidden](unsigned int block_id, const BlockMappingInfo& block_info) {
+        return block_info.cache_location != NO_CACHE_LOC_ASSIGNED && cache[block_info.cache_location].logical_block_id == std::make_pair(hidden, block_id);
+    };
+    std::vector<std::pair<unsigned int, unsigned int>> to_read;
+    {
+        std::lock_guard<std::mutex> lg(lock);
+        auto space = partitions[hidden].entries < partitionQuota(hidden) ? partitionQuota(hidden) - partitions[hidden].entries : 0;
+        for (auto block_id : block_ids) {
+            if (to_read.size() >= std::min(space, static_cast<unsigned int>(unused_cache_entries.size()))) {
+                break;
+            }
+            auto block_info = findBlock({hidden, block_id});
+            if (block_info && block_info->physical_block_id != NO_BLOCK_ASSIGNED && !is_cached(block_id, *block_info)) {
+                to_read.push_back({block_info->physical_block_id, block_id});
+            }
+        }
+    }
+    std::sort(to_read.begin(), to_read.end());
+
+    secure_string data(PREFETCH_BATCH * LOGICAL_BLOCK_SIZE, '\0');
+    for (auto start = 0u; start < to_read.size(); start += PREFETCH_BATCH) {
+        std::lock_guard<std::mutex> lg(lock);
+        // Blocks may have been written, moved, freed or read by an operation since they were listed
+        std::vector<std::pair<unsigned int, unsigned int>> batch;
+        for (auto i = start; i < std::min(start + PREFETCH_BATCH, static_cast<unsigned int>(to_read.size())); ++i) {
+            auto [phy_blk_id, block_id] = to_read[i];
+            auto block_info = findBlock({hidden, block_id});
+            if (block_info && block_info->physical_block_id == phy_blk_id && !is_cached(block_id, *block_info)) {
+                batch.push_back(to_read[i]);
+            }
+        }
+        for (auto i = 0u; i < batch.size();) {
+            auto run = 1u;
+            while (i + run < batch.size() && batch[i + run].first == batch[i].first + run) {
+                ++run;
+            }
+            disk.readBlocks(batch[i].first + number_of_mapping_blocks * 2, run, hidden, &data[i * LOGICAL_BLOCK_SIZE]);
+            i += run;
+        }
+        for (auto i = 0u; i < batch.size(); ++i) {
+            auto [phy_blk_id, block_id] = batch[i];
+            if (unused_cache_entries.empty() || partitions[hidden].entries >= partitionQuota(hidden)) {
+                return;
+            }
+            auto cache_location = unused_cache_entries.front();
+            unused_cache_entries.pop_front();
+            ++partitions[hidden].entries;
+            auto& cache_entry = cache[cache_location];
+            cache_entry.logical_block_id = {hidden, block_id};
+            cache_entry.dirty = false;
+            cache_entry.priority = CachePriority::DATA;
+            auto pending = flush_snapshot.locations.find(phy_blk_id);
+            if (pending != flush_snapshot.locations.end()) {
+                // Still being written by the background flush, so what is on the disk may be out of date
+                std::copy_n(flush_snapshot.writes[pending->second].data.begin(), LOGICAL_BLOCK_SIZE, cache_entry.data);
+            }
+            else {
+                std::copy_n(&data[i * LOGICAL_BLOCK_SIZE], LOGICAL_BLOCK_SIZE, cache_entry.data);
+            }
+            blockInfo({hidden, block_id}).cache_location = cache_location;
+            partitions[hidden].least_recently_used.push_front(cache_location);
+        }
+    }
+}
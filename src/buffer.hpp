@@ -19,64 +19,156 @@
 #ifndef BUFFER_HPP
 #define BUFFER_HPP
 
-#include <map>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <vector>
 #include <deque>
+#include <exception>
+#include <list>
+#include <memory>
 #include <mutex>
-#include <set>
 #include <thread>
+#include <unordered_map>
 
 #include "types.hpp"
+#include "slab.hpp"
 
 
 class Disk;
 class Buffer;
 
+namespace CryptoPP {
+    class RandomNumberGenerator;
+}
+
 const unsigned int NO_BLOCK_ASSIGNED = -1;
 const unsigned int NO_CACHE_LOC_ASSIGNED = -1;
 
 struct BlockMappingInfo {
     unsigned int physical_block_id = NO_BLOCK_ASSIGNED;
     unsigned int cache_location = NO_CACHE_LOC_ASSIGNED;
+    bool allocated = false;
+};
+
+// The reverse mapping for the physical blocks covered by one cover / hidden mapping table block pair.
+// Each entry is packed into 32 bits (see packMappingEntry).
+struct MappingPage {
+    std::vector<std::uint32_t> entries;
+    bool dirty = false, in_flight = false;
+    std::list<unsigned int>::iterator lru_position;
+};
+
+// Metadata (directory nodes, block tree nodes and file headers) is kept in a protected part of the
+// cache, so that streaming file data through the cache does not evict it
+enum class CachePriority {
+    DATA,
+    METADATA
+};
+
+// Any number of shared accessors may hold a block at once, but they may only read it
+enum class AccessMode {
+    EXCLUSIVE,
+    SHARED
+};
+
+// The clean cache entries holding one aspect's blocks, least recently used first, and how many entries
+// it has in all (including dirty ones and those in use)
+struct CachePartition {
+    std::deque<unsigned int> least_recently_used, metadata_least_recently_used;
+    unsigned int entries = 0;
 };
 
-struct BlockCacheEntry {
+struct PendingWrite {
+    unsigned int physical_block_id;
+    bool hidden;
+    // Empty for virtual blocks, which are filled with random data as they are written
     secure_string data;
+    // The whole physical block, if the data was encrypted ahead of the flush
+    secure_string ciphertext = {};
+};
+
+struct PendingMappingWrite {
+    unsigned int mapping_block;
+    secure_string cover_data, hidden_data;
+};
+
+// A flush which has been decided on, but which is still being written in the background (or which failed, and is
+// to be retried by the next flush)
+struct FlushSnapshot {
+    std::vector<PendingWrite> writes;
+    std::vector<PendingMappingWrite> mapping_writes;
+    // Data block -> index into writes, for reading blocks which have not reached the disk yet
+    std::unordered_map<unsigned int, unsigned int> locations;
+};
+
+// The block data lives in the buffer's slab. The metadata is padded to a cache line, so that
+// neighbouring entries are not falsely shared.
+struct alignas(64) BlockCacheEntry {
+    unsigned char* data;
     std::pair<bool, unsigned int> logical_block_id = {false, NO_BLOCK_ASSIGNED};
     bool dirty = false, dirtied_by_current = false;
-    std::mutex lock;
+    CachePriority priority = CachePriority::DATA;
+    // Held by an exclusive accessor, or by this many shared ones. All are guarded by Buffer::lock, and threads
+    // wanting the entry wait on released.
+    bool busy = false;
+    unsigned int readers = 0;
+    std::condition_variable released;
+    // Ciphertext of the dirty data, encrypted while the buffer is idle (empty if there is none), and a stamp
+    // which changes whenever the data does, so that ciphertext which has gone stale can be spotted
+    secure_string staged;
+    unsigned long version = 0;
 
-    BlockCacheEntry();
+    BlockCacheEntry(unsigned char* data);
 };
 
 class BlockAccessor {
     Buffer& buffer_;
     BlockCacheEntry& cache_entry;
+    bool shared;
     bool moved = false;
 
 public:
-    BlockAccessor(Buffer& buffer, BlockCacheEntry& cache_entry);
+    BlockAccessor(Buffer& buffer, BlockCacheEntry& cache_entry, bool shared);
     BlockAccessor(BlockAccessor&& other);
     ~BlockAccessor();
 
-    const secure_string& read() const;
-    secure_string& writable();
+    const unsigned char* read() const;
+    unsigned char* writable();
     std::pair<bool, unsigned int> block_id() const;
     Buffer& buffer() const;
 };
 
+// Reservations are estimated for each type of operation from the shape of the trees it walks
+enum class OperationType {
+    LOOKUP,
+    READ,
+    WRITE,
+    CREATE,
+    REMOVE,
+    RENAME,
+    TRUNCATE,
+    OTHER
+};
+
 struct BufferOperationData {
     unsigned int max_blocks;
+    // The caller's worst case, which the reservation grows up to if it turns out to be too small
+    unsigned int worst_case_blocks;
     char hidden = 2;
-    std::set<unsigned int> blocks = {};
+    // Sorted, so that it works as a small flat set
+    std::vector<unsigned int> blocks = {};
     unsigned int block_requests = 0, block_writes = 0, max_cache_takeup = 0;
 };
 
+// Owns the bookkeeping for the operation, which only the owning thread touches (through a thread-local pointer)
 class BufferOperation {
     Buffer& buffer;
+    BufferOperationData data;
 
 public:
-    BufferOperation(Buffer& buf);
+    BufferOperation(Buffer& buf, unsigned int max_blocks, unsigned int worst_case_blocks);
     BufferOperation(BufferOperation&) = delete;
     BufferOperation(BufferOperation&&) = delete;
     ~BufferOperation();
@@ -87,47 +179,134 @@ public:
 class Buffer {
     Disk& disk;
     std::mutex lock;
-    std::map<std::pair<bool, unsigned int>, BlockMappingInfo> block_mapping;
-    unsigned int max_cover_id = 0, max_hidden_id = 0, number_of_mapping_blocks = 0;
+    std::vector<BlockMappingInfo> cover_block_mapping, hidden_block_mapping;
+    unsigned int number_of_mapping_blocks = 0;
+    // Min-heaps of freed logical IDs, so that the lowest is reused first
+    std::vector<unsigned int> free_cover_ids, free_hidden_ids;
     unsigned int cover_blocks_allocated = 0, hidden_blocks_allocated = 0, reserved_cache_space = 0;
-    unsigned int cover_blocks_changed = 0, hidden_blocks_changed;
-    std::vector<unsigned int> unallocated_list, virtual_list;
+    unsigned int cover_blocks_changed = 0, hidden_blocks_changed = 0;
+    std::vector<unsigned int> virtual_list;
 
-    std::vector<std::pair<bool, unsigned int>> reverse_block_mapping;
-    std::vector<BlockCacheEntry> cache;
-    std::deque<unsigned int> least_recently_used;
-    std::map<std::thread::id, BufferOperationData> operation_for_thread;
+    // Reverse mapping, paged in from the mapping table on demand. Dirty pages stay resident until flushed.
+    std::vector<std::unique_ptr<MappingPage>> mapping_pages;
+    std::list<unsigned int> clean_mapping_pages;
+    unsigned int mapping_cache_size, resident_mapping_pages = 0;
+    // One bit per physical block, set when it is free, with a Fenwick tree over the number of free blocks
+    // in each superblock of FREE_BITMAP_SUPERBLOCK_WORDS words for rank / select
+    std::vector<std::uint64_t> free_bitmap;
+    std::vector<unsigned int> free_blocks_tree;
+    unsigned int free_blocks = 0;
+    // Physical blocks freed since the table on disk was written, which it may still point at. The first
+    // committing_frees of them were freed before the table being written in the background was snapshotted.
+    std::vector<unsigned int> freed_since_commit;
+    unsigned int committing_frees = 0;
+    Slab slab;
+    // A deque so that the cache can be resized without moving the (locked) entries
+    std::deque<BlockCacheEntry> cache;
+    unsigned int target_cache_size;
+    std::atomic<bool> memory_pressure = false;
+    // Entries holding no block are shared. Otherwise each aspect has its own partition, and may only grow
+    // past its share of the cache while the other aspect does not need the space.
+    std::deque<unsigned int> unused_cache_entries;
+    std::array<CachePartition, 2> partitions;
+    unsigned int hidden_cache_share;
+    bool cache_borrowing;
+    // Blocks a flush may place in one contiguous run. 1 places every block at random.
+    unsigned int locality;
+    unsigned int running_operations = 0;
+    // Cache space reserved by running operations, and by those of them known to be in the cover aspect. The
+    // rest may still change hidden blocks, so spilling dirty blocks leaves enough cover changes for them.
+    unsigned int operation_space = 0, cover_operation_space = 0;
+    // Tallest directory B-tree and deepest file block tree seen so far, which reservations are estimated from
+    std::atomic<unsigned int> tallest_dir = 0, deepest_tree = 0;
     bool enforce_operations, debug, no_hidden;
-    std::mutex wait_for_ops_done, wait_for_flush_done;
+    // Signalled when the last operation ends while a flush is waiting, when that flush is done, and when
+    // an operation leaves the admission queue
+    std::condition_variable ops_done, flush_done, admission_changed;
     bool thread_is_waiting_to_flush = false;
-    unsigned int waiting_for_flush_to_finish = 0;
+    unsigned int waiting_interactive_operations = 0, interactive_admissions_while_flushing = 0;
+    // Tickets of the operations waiting to start, oldest first, and how often the oldest has been overtaken
+    std::deque<unsigned long> admission_queue;
+    unsigned long next_admission_ticket = 0;
+    unsigned int head_bypasses = 0;
+    FlushSnapshot flush_snapshot;
+    std::thread flush_thread;
+    std::atomic<bool> flush_thread_done = false;
+    // Set by a background flush which failed, until the next one starts. Its data writes stay in the snapshot.
+    std::exception_ptr flush_error;
+    // Random physical blocks for virtual block writes. Only touched by the flush thread.
+    std::vector<secure_string> chaff_pool;
+    // Encrypts dirty entries ahead of the flush. Woken when there may be work for it, and stopped on destruction.
+    std::thread staging_thread;
+    std::condition_variable staging_wanted;
+    bool staging_pending = false, stopping = false;
+    unsigned int staging_cursor = 0;
+    unsigned long next_entry_version = 0;
 
     void scanEntriesTable();
-    void writeEntriesTable();
-    unsigned int freeCacheEntry();
-    void return_block(BlockCacheEntry& cache_entry);
-    void end_operation();
+    void snapshotEntriesTable();
+    void encodeMappingBlock(unsigned int mapping_block, const MappingPage& page, secure_string& cover_buf, secure_string& hidden_buf);
+    void readMappingPage(unsigned int mapping_block, std::vector<std::uint32_t>& entries);
+    MappingPage& mappingPage(unsigned int mapping_block);
+    void evictMappingPages(unsigned int limit);
+    void setReverseMapping(unsigned int phy_blk_id, std::pair<bool, unsigned int> logical_block_id);
+    void setFree(unsigned int phy_blk_id, bool free);
+    bool isFree(unsigned int phy_blk_id);
+    unsigned int randomFreeBlock(CryptoPP::RandomNumberGenerator& rng);
+    BlockMappingInfo* findBlock(std::pair<bool, unsigned int> logical_block_id);
+    BlockMappingInfo& blockInfo(std::pair<bool, unsigned int> logical_block_id);
+    unsigned int takeFreeId(bool hidden);
+    void releaseId(bool hidden, unsigned int block_id);
+    unsigned int freeCacheEntry(bool hidden);
+    unsigned int pickCacheEntry(bool hidden, bool ignore_quotas);
+    unsigned int evictCacheEntry(bool hidden);
+    unsigned int partitionQuota(bool hidden);
+    unsigned int idleCacheEntries();
+    std::deque<unsigned int>& lruFor(bool hidden, CachePriority priority);
+    bool inLRU(unsigned int cache_location);
+    void return_block(BlockCacheEntry& cache_entry, bool shared);
+    void leaveAdmissionQueue(unsigned long ticket, bool interactive, bool admitted);
+    unsigned int estimateBlocks(OperationType type, unsigned int worst_case_blocks, unsigned int data_blocks);
+    void end_operation(BufferOperationData& data);
     void op_requested(unsigned int block_id, bool hid);
     void op_released(unsigned int block_id, bool hid, bool dirty);
     void unlocked_flush();
+    void addChaff(std::vector<std::pair<char, unsigned int>>& to_flush, std::vector<std::pair<unsigned int, secure_string>>& relocated, unsigned int num_chaff);
+    void pruneFailedWrites();
+    void placeFlushWrites(std::vector<std::pair<char, unsigned int>>& to_flush, std::vector<std::pair<unsigned int, secure_string>>& relocated);
+    void spillDirtyBlocks();
+    void writeFlushSnapshot();
+    void finishBackgroundFlush();
+    void stageDirtyBlocks();
+    unsigned int nextStagingCandidate();
+    void growCache();
+    void shrinkCache();
     BufferOperationData& current_operation();
 
 public:
-    Buffer(Disk& disk, unsigned int cache_size, bool wipe_mapping_table, bool enforce_operations, bool debug, bool no_hidden);
+    Buffer(Disk& disk, unsigned int cache_size, unsigned int mapping_cache_size, unsigned int hidden_cache_share, bool cache_borrowing, unsigned int locality, bool wipe_mapping_table, bool enforce_operations, bool debug, bool no_hidden);
+    ~Buffer();
 
     unsigned int totalBlocks();
     unsigned int blocksAllocated();
     unsigned int blocksForAspect(bool hidden);
     unsigned int blocksAllocatedForAspect(bool hidden);
 
-    BlockAccessor block(unsigned int block_id, bool hidden);
-    BlockAccessor allocateBlock(bool hidden);
+    BlockAccessor block(unsigned int block_id, bool hidden, CachePriority priority = CachePriority::DATA, AccessMode mode = AccessMode::EXCLUSIVE);
+    BlockAccessor allocateBlock(bool hidden, CachePriority priority = CachePriority::DATA);
     void deallocateBlock(unsigned int block_id, bool hidden);
     void flush();
-    BufferOperation operation(unsigned int max_blocks);
+    BufferOperation operation(unsigned int max_blocks, OperationType type = OperationType::OTHER, unsigned int data_blocks = 0);
+    void noteDirHeight(unsigned int height);
+    void noteTreeDepth(unsigned int depth);
+    unsigned int cacheSize();
+    void resizeCache(unsigned int cache_size);
+    void signalMemoryPressure();
     inline bool isDebugging() const { return debug; }
     inline bool hasHidden() const { return !no_hidden; }
     bool allowed(bool hidden, unsigned int allocated, unsigned int changed, unsigned int deallocated);
+    std::vector<unsigned int> hotBlocks(bool hidden, unsigned int limit);
+    void prefetch(const std::vector<unsigned int>& block_ids, bool hidden);
 
     friend class BlockAccessor;
     friend class BufferOperation;
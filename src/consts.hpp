@@ -46,5 +46,38 @@ const unsigned int DIR_LOOKUP_COST = 10;
 const unsigned int DIR_WRITE_COST = DIR_LOOKUP_COST * 2;
 
 const unsigned int FILE_LOOKUP_COST = 4;
+// Largest part of a write done in one operation
+const unsigned int WRITE_CHUNK_SIZE = 64 * LOGICAL_BLOCK_SIZE;
+
+// Added to the estimate of an operation's reservation from the heights of the trees
+const unsigned int OPERATION_RESERVATION_SLACK = 2;
+
+// Words of the free block bitmap counted by each node of its Fenwick tree
+const unsigned int FREE_BITMAP_SUPERBLOCK_WORDS = 8;
+
+// Bulk operations may not reserve the last 1 / INTERACTIVE_CACHE_HEADROOM of the cache, which is kept for metadata operations
+const unsigned int INTERACTIVE_CACHE_HEADROOM = 8;
+// Metadata operations which may start while a flush is waiting for the running operations to end
+const unsigned int MAX_INTERACTIVE_ADMISSIONS_WHILE_FLUSHING = 64;
+// Times the oldest waiting operation may be overtaken by newer ones before they have to wait for it
+const unsigned int MAX_ADMISSION_BYPASSES = 16;
+
+const unsigned int MIN_CACHE_SIZE = 256;
+const unsigned int MAX_CACHE_SIZE = 1 << 24;
+const unsigned int CHAFF_POOL_SIZE = 64;
+// Most adjacent blocks a flush writes to the disk in one go
+const unsigned int MAX_COALESCED_WRITE_BLOCKS = 64;
+// Most cover blocks written by one partial flush, when every cache entry is dirty or in use
+const unsigned int SPILL_BLOCKS = 64;
+// Metadata may take up to 1 / METADATA_CACHE_SHARE of the cache before it competes with data
+const unsigned int METADATA_CACHE_SHARE = 4;
+// Most recently used blocks of each aspect saved at unmount, to be prefetched at the next mount
+const unsigned int HOT_SET_BLOCKS = 4096;
+// Percentage of the cache set aside for the hidden aspect unless --hidden-cache-share says otherwise
+const unsigned int DEFAULT_HIDDEN_CACHE_SHARE = 50;
+// Blocks prefetched for each time the buffer is locked
+const unsigned int PREFETCH_BATCH = 64;
+// Milliseconds without operations before dirty blocks are encrypted ahead of the flush
+const unsigned int PRE_ENCRYPTION_DELAY = 100;
 
 #endif // CONSTS_HPP
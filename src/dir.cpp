@@ -16,6 +16,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 
@@ -31,13 +32,14 @@ const unsigned int BTREE_NODE_SIZE = LOGICAL_BLOCK_SIZE;
 
 
 Dir::Dir(Buffer& buf, unsigned int block_id, bool hidden) :
-        Dir(buf, buf.block(block_id, hidden)) {
+        Dir(buf, buf.block(block_id, hidden, CachePriority::METADATA)) {
 }
 
 Dir::Dir(Buffer& buf, BlockAccessor&& header_acc) :
         buffer(buf), header_acc(std::move(header_acc)) {
 
     ensure(this->header_acc.read()[0] == DIR_TYPE, "Dir::Dir") << "This block is not a file header";
+    buffer.noteDirHeight(height());
 }
 
 Dir::Dir(Dir&& other) :
@@ -76,13 +78,8 @@ bool node_full(const BlockAccessor& acc, unsigned int offset, unsigned int size,
     return intFromBytes(&acc.read()[fname_location(offset, num_keys(size, is_leaf) - 1, is_leaf) + FILE_NAME_SIZE]) != NO_BLOCK;
 }
 
-secure_string fname_from_bytes(const secure_string& bytes, unsigned int pos) {
-    auto full = bytes.substr(pos, FILE_NAME_SIZE);
-    auto zero_pos = full.find('\0');
-    if (zero_pos != secure_string::npos) {
-        full.erase(zero_pos);
-    }
-    return full;
+secure_string fname_from_bytes(const unsigned char* bytes, unsigned int pos) {
+    return {bytes + pos, std::find(bytes + pos, bytes + pos + FILE_NAME_SIZE, '\0')};
 }
 
 unsigned int node_used(const BlockAccessor& acc, unsigned int offset, unsigned int size, bool is_leaf) {
@@ -140,8 +137,8 @@ void insert_to_node(const secure_string& fname, unsigned int value, unsigned int
             &acc.writable()[bytes_pos],
             record_size(is_leaf) * (no_keys - idx - 1));
 
-    acc.writable().replace(bytes_pos, FILE_NAME_SIZE, FILE_NAME_SIZE, '\0');
-    acc.writable().replace(bytes_pos, std::min(fname.size(), static_cast<unsigned long>(FILE_NAME_SIZE)), fname);
+    memset(&acc.writable()[bytes_pos], '\0', FILE_NAME_SIZE);
+    memcpy(&acc.writable()[bytes_pos], fname.c_str(), std::min(fname.size(), static_cast<unsigned long>(FILE_NAME_SIZE)));
     intToBytes(&acc.writable()[bytes_pos + FILE_NAME_SIZE], value);
     if (!is_leaf) {
         intToBytes(&acc.writable()[bytes_pos + FILE_NAME_SIZE + 4], child);
@@ -162,13 +159,14 @@ void remove_from_node(unsigned int idx, BlockAccessor& acc, unsigned int offset,
 }
 
 void Dir::split_root() {
-    auto new_block_acc = buffer.allocateBlock(block_id().first);
+    auto new_block_acc = buffer.allocateBlock(block_id().first, CachePriority::METADATA);
     clean_node_block(new_block_acc, BTREE_NODE_OFFSET, BTREE_NODE_SIZE, height() == 0);
     memcpy(&new_block_acc.writable()[0], &header_acc.read()[BTREE_HEADER_OFFSET], BTREE_HEADER_SIZE);
     clean_node_block(header_acc, BTREE_HEADER_OFFSET, BTREE_HEADER_SIZE, false);
     intToBytes(&header_acc.writable()[BTREE_HEADER_OFFSET], new_block_acc.block_id().second);
     intToBytes(&header_acc.writable()[1], blocks() + 1);
     intToBytes(&header_acc.writable()[5], height() + 1);
+    buffer.noteDirHeight(height());
 }
 
 void Dir::unsplit_root() {
@@ -178,7 +176,7 @@ void Dir::unsplit_root() {
 
     auto old_block_id = intFromBytes(&header_acc.read()[BTREE_HEADER_OFFSET]);
     {
-        auto old_block_acc = buffer.block(old_block_id, block_id().first);
+        auto old_block_acc = buffer.block(old_block_id, block_id().first, CachePriority::METADATA);
         ensure(node_used(old_block_acc, BTREE_NODE_OFFSET, BTREE_NODE_SIZE, height() == 1) <= num_keys(BTREE_HEADER_SIZE, height() == 1), "Dir::unsplit_root")
             << "Can't unsplit root when it's only child has " << node_used(old_block_acc, BTREE_NODE_OFFSET, BTREE_NODE_SIZE, height() == 1) + 1 << " children";
         memcpy(&header_acc.writable()[BTREE_HEADER_OFFSET], &old_block_acc.read()[BTREE_NODE_OFFSET], BTREE_HEADER_SIZE);
@@ -189,8 +187,8 @@ void Dir::unsplit_root() {
 }
 
 std::tuple<unsigned int, secure_string, unsigned int> Dir::split_node(unsigned int blck_id, unsigned int height) {
-    auto acc = buffer.block(blck_id, block_id().first);
-    auto new_acc = buffer.allocateBlock(block_id().first);
+    auto acc = buffer.block(blck_id, block_id().first, CachePriority::METADATA);
+    auto new_acc = buffer.allocateBlock(block_id().first, CachePriority::METADATA);
     auto is_leaf = height == 0;
     auto size = num_keys(BTREE_NODE_SIZE, is_leaf);
     auto middle_idx = size / 2;
@@ -205,7 +203,7 @@ std::tuple<unsigned int, secure_string, unsigned int> Dir::split_node(unsigned i
 }
 
 bool Dir::node_add(const secure_string& fname, unsigned int value, unsigned int blck_id, unsigned int height) {
-    auto acc = buffer.block(blck_id, block_id().first);
+    auto acc = buffer.block(blck_id, block_id().first, CachePriority::METADATA);
     if (height == 0) {
         // Leaf
         if (node_full(acc, BTREE_NODE_OFFSET, BTREE_NODE_SIZE, true)) {
@@ -286,7 +284,7 @@ void Dir::refill_node(BlockAccessor& top_acc, unsigned int uf_pos, unsigned int
     }
     auto uf_blk_id = intFromBytes(&top_acc.read()[uf_byte_pos - 4]);
     {
-        auto uf_acc = buffer.block(uf_blk_id, block_id().first);
+        auto uf_acc = buffer.block(uf_blk_id, block_id().first, CachePriority::METADATA);
         auto top_used = node_used(top_acc, top_offset, top_size, false);
         auto child_is_leaf = !(height - 1);
         auto uf_used = node_used(uf_acc, BTREE_NODE_OFFSET, BTREE_NODE_SIZE, child_is_leaf);
@@ -294,7 +292,7 @@ void Dir::refill_node(BlockAccessor& top_acc, unsigned int uf_pos, unsigned int
 
         if (uf_pos) {
             auto left_byte_pos = uf_byte_pos - record_size(false);
-            auto left_acc = buffer.block(intFromBytes(&top_acc.read()[left_byte_pos - 4]), block_id().first);
+            auto left_acc = buffer.block(intFromBytes(&top_acc.read()[left_byte_pos - 4]), block_id().first, CachePriority::METADATA);
             auto left_used = node_used(left_acc, BTREE_NODE_OFFSET, BTREE_NODE_SIZE, child_is_leaf);
             if (left_used - 1 > half_child_num_keys) {
                 if (top_acc.buffer().isDebugging()) {
@@ -335,7 +333,7 @@ void Dir::refill_node(BlockAccessor& top_acc, unsigned int uf_pos, unsigned int
 
         if (uf_pos < top_used) {
             auto right_byte_pos = uf_byte_pos + record_size(false);
-            auto right_acc = buffer.block(intFromBytes(&top_acc.read()[right_byte_pos - 4]), block_id().first);
+            auto right_acc = buffer.block(intFromBytes(&top_acc.read()[right_byte_pos - 4]), block_id().first, CachePriority::METADATA);
             auto right_used = node_used(right_acc, BTREE_NODE_OFFSET, BTREE_NODE_SIZE, child_is_leaf);
             if (right_used - 1 > half_child_num_keys) {
                 if (top_acc.buffer().isDebugging()) {
@@ -381,7 +379,7 @@ void Dir::refill_node(BlockAccessor& top_acc, unsigned int uf_pos, unsigned int
                 std::cout << "Merge with left" << std::endl;
             }
             auto left_byte_pos = uf_byte_pos - record_size(false);
-            auto left_acc = buffer.block(intFromBytes(&top_acc.read()[left_byte_pos - 4]), block_id().first);
+            auto left_acc = buffer.block(intFromBytes(&top_acc.read()[left_byte_pos - 4]), block_id().first, CachePriority::METADATA);
             auto left_used = node_used(left_acc, BTREE_NODE_OFFSET, BTREE_NODE_SIZE, child_is_leaf);
             // Top -> Left
             memcpy(
@@ -404,7 +402,7 @@ void Dir::refill_node(BlockAccessor& top_acc, unsigned int uf_pos, unsigned int
                 std::cout << "Merge with right" << std::endl;
             }
             auto right_byte_pos = uf_byte_pos + record_size(false);
-            auto right_acc = buffer.block(intFromBytes(&top_acc.read()[right_byte_pos - 4]), block_id().first);
+            auto right_acc = buffer.block(intFromBytes(&top_acc.read()[right_byte_pos - 4]), block_id().first, CachePriority::METADATA);
             auto right_used = node_used(right_acc, BTREE_NODE_OFFSET, BTREE_NODE_SIZE, child_is_leaf);
 
             // Move right entries down to make space
@@ -445,7 +443,7 @@ bool Dir::pop_left_largest_and_replace_rec(BlockAccessor& orig_acc, unsigned int
                                            BlockAccessor& acc, unsigned int byte_pos, unsigned int height) {
     auto blk_id = intFromBytes(&acc.read()[byte_pos-4]);
     --height;
-    auto left_acc = buffer.block(blk_id, acc.block_id().first);
+    auto left_acc = buffer.block(blk_id, acc.block_id().first, CachePriority::METADATA);
     if (!height) {
         auto left_pos = node_used(left_acc, BTREE_NODE_OFFSET, BTREE_NODE_SIZE, !height) - 1;
         auto left_byte_pos = fname_location(BTREE_NODE_OFFSET, left_pos, !height);
@@ -473,7 +471,7 @@ bool Dir::pop_left_largest_and_replace(BlockAccessor& acc, unsigned int byte_pos
 }
 
 std::pair<unsigned int, bool> Dir::node_remove(const secure_string& fname, unsigned int blck_id, unsigned int height) {
-    auto acc = buffer.block(blck_id, block_id().first);
+    auto acc = buffer.block(blck_id, block_id().first, CachePriority::METADATA);
     if (height == 0) {
         // Leaf
         auto pos = find_key_pos(fname, acc, BTREE_NODE_OFFSET, BTREE_NODE_SIZE, true);
@@ -558,7 +556,7 @@ void print_single(const BlockAccessor& acc, unsigned int byte_pos, unsigned int
 
 void rec_print_node(Buffer& buf, unsigned int block_id, bool hidden, unsigned int height, unsigned int total_height) {
     auto is_leaf = height == 0;
-    auto acc = buf.block(block_id, hidden);
+    auto acc = buf.block(block_id, hidden, CachePriority::METADATA);
     if (!is_leaf) {
         rec_print_node(buf, intFromBytes(&acc.read()[BTREE_NODE_OFFSET]), hidden, height - 1, total_height);
     }
@@ -589,8 +587,8 @@ void Dir::debug() {
 }
 
 Dir Dir::newDir(Buffer& buffer, bool hidden) {
-    auto acc = buffer.allocateBlock(hidden);
-    auto& data = acc.writable();
+    auto acc = buffer.allocateBlock(hidden, CachePriority::METADATA);
+    auto data = acc.writable();
     intToBytes(&data[0], DIR_TYPE);
     intToBytes(&data[BLOCK_TREE_OFFSET], 0);
     intToBytes(&data[BLOCK_TREE_OFFSET + 4], 0);
@@ -608,7 +606,7 @@ DirIterator Dir::begin() const {
     positions.push_back(0);
     auto blk_id = intFromBytes(&header_acc.read()[BTREE_HEADER_OFFSET]);
     for (auto h = 0u; h < height(); ++h) {
-        accessors.emplace_back(buffer.block(blk_id, block_id().first));
+        accessors.emplace_back(buffer.block(blk_id, block_id().first, CachePriority::METADATA, AccessMode::SHARED));
         positions.push_back(0);
         blk_id = intFromBytes(&accessors.back().read()[BTREE_NODE_OFFSET]);
     }
@@ -635,7 +633,7 @@ DirIterator Dir::find(const secure_string& fname) const {
         if (fname_equals(fname, acc, pos)) {
             return {*this, std::move(accessors), std::move(positions), block_id().first};
         }
-        accessors.emplace_back(buffer.block(blk_id, block_id().first));
+        accessors.emplace_back(buffer.block(blk_id, block_id().first, CachePriority::METADATA, AccessMode::SHARED));
         positions.push_back(find_key_pos_or_end(fname, accessors.back(), BTREE_NODE_OFFSET, BTREE_NODE_SIZE, height_ == h + 1));
         pos = fname_location(BTREE_NODE_OFFSET, positions.back(), height_ == h + 1);
         if (height_ != h + 1) {
@@ -673,7 +671,7 @@ DirIterator& DirIterator::operator++() {
             auto pos = fname_location(offset, positions.back(), is_leaf);
             auto blk_id = intFromBytes(&accessor.read()[pos + FILE_NAME_SIZE + 4]);
             for (auto j = 0u; level + j < dir.height(); ++j) {
-                accessors.push_back(dir.buffer.block(blk_id, hidden));
+                accessors.push_back(dir.buffer.block(blk_id, hidden, CachePriority::METADATA, AccessMode::SHARED));
                 positions.push_back(0);
                 blk_id = intFromBytes(&accessors.back().read()[BTREE_NODE_OFFSET]);
             }
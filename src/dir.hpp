@@ -23,6 +23,7 @@
 
 class Dir;
 
+// Only reads the nodes, so holds them shared
 class DirIterator {
     const Dir& dir;
     std::vector<BlockAccessor> accessors;
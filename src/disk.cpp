@@ -59,9 +59,8 @@ void Disk::writeRawBlock(unsigned int location, const secure_string& in) {
     file.write(reinterpret_cast<const char*>(&in[0]), in.size());
 }
 
-void Disk::decryptBlock(const secure_string& in, secure_string& out, bool hidden) const {
-    ensure(in.size() % CIPHER_BLOCK_SIZE == 0, "Disk::decryptBlock") << "Input is not a multiple of the cipher block size";
-    ensure(out.size() == in.size() - IV_SIZE, "Disk::decryptBlock") << "Output is not the correct size";
+void Disk::decryptBlock(const secure_string& in, unsigned char* out, bool hidden) const {
+    ensure(in.size() == PHYSICAL_BLOCK_SIZE, "Disk::decryptBlock") << "Input is not the correct size";
 
     CryptoPP::CBC_Mode<CryptoPP::AES>::Decryption d;
     if (hidden) {
@@ -74,15 +73,14 @@ void Disk::decryptBlock(const secure_string& in, secure_string& out, bool hidden
     CryptoPP::StringSource ss(&in[IV_SIZE], LOGICAL_BLOCK_SIZE, true,
         new CryptoPP::StreamTransformationFilter(
             d,
-            new CryptoPP::ArraySink(&out[0], LOGICAL_BLOCK_SIZE),
+            new CryptoPP::ArraySink(out, LOGICAL_BLOCK_SIZE),
             CryptoPP::StreamTransformationFilter::NO_PADDING
         )
     );
 }
 
-void Disk::encryptBlock(const secure_string& in, secure_string& out, bool hidden) const {
-    ensure(in.size() % CIPHER_BLOCK_SIZE == 0, "Disk::encryptBlock") << "Input is not a multiple of the cipher block size";
-    ensure(out.size() == in.size() + IV_SIZE, "Disk::encryptBlock") << "Output is not the correct size";
+void Disk::encryptBlock(const unsigned char* in, secure_string& out, bool hidden) const {
+    ensure(out.size() == PHYSICAL_BLOCK_SIZE, "Disk::encryptBlock") << "Output is not the correct size";
 
     CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption e;
 
@@ -95,7 +93,7 @@ void Disk::encryptBlock(const secure_string& in, secure_string& out, bool hidden
         e.SetKeyWithIV(&cover_key[0], cover_key.size(), &out[0]);
     }
 
-    CryptoPP::StringSource ss(&in[0], LOGICAL_BLOCK_SIZE, true,
+    CryptoPP::StringSource ss(in, LOGICAL_BLOCK_SIZE, true,
         new CryptoPP::StreamTransformationFilter(
             e,
             new CryptoPP::ArraySink(&out[IV_SIZE], LOGICAL_BLOCK_SIZE),
@@ -106,22 +104,49 @@ void Disk::encryptBlock(const secure_string& in, secure_string& out, bool hidden
 
 void Disk::readBlock(unsigned int location, bool hidden, secure_string& buffer) {
     ensure(buffer.size() == LOGICAL_BLOCK_SIZE, "Disk::readBlock") << "Output is not the correct size";
+    readBlock(location, hidden, &buffer[0]);
+}
+
+void Disk::writeBlock(unsigned int location, bool hidden, const secure_string& buffer) {
+    ensure(buffer.size() == LOGICAL_BLOCK_SIZE, "Disk::writeBlock") << "Input is not the correct size";
+    writeBlock(location, hidden, &buffer[0]);
+}
 
+void Disk::readBlock(unsigned int location, bool hidden, unsigned char* buffer) {
     secure_string physical_block_buffer(PHYSICAL_BLOCK_SIZE, '\0');
 
     readRawBlock(location * PHYSICAL_BLOCK_SIZE, physical_block_buffer);
     decryptBlock(physical_block_buffer, buffer, hidden);
 }
 
-void Disk::writeBlock(unsigned int location, bool hidden, const secure_string& buffer) {
-    ensure(buffer.size() == LOGICAL_BLOCK_SIZE, "Disk::writeBlock") << "Input is not the correct size";
-
+void Disk::writeBlock(unsigned int location, bool hidden, const unsigned char* buffer) {
     secure_string physical_block_buffer(PHYSICAL_BLOCK_SIZE, '\0');
 
     encryptBlock(buffer, physical_block_buffer, hidden);
     writeRawBlock(location * PHYSICAL_BLOCK_SIZE, physical_block_buffer);
 }
 
+void Disk::readBlocks(unsigned int location, unsigned int count, bool hidden, unsigned char* buffer) {
+    secure_string physical_blocks_buffer(count * PHYSICAL_BLOCK_SIZE, '\0');
+    secure_string physical_block_buffer(PHYSICAL_BLOCK_SIZE, '\0');
+
+    readRawBlock(location * PHYSICAL_BLOCK_SIZE, physical_blocks_buffer);
+    for (auto i = 0u; i < count; ++i) {
+        std::copy_n(&physical_blocks_buffer[i * PHYSICAL_BLOCK_SIZE], PHYSICAL_BLOCK_SIZE, physical_block_buffer.begin());
+        decryptBlock(physical_block_buffer, &buffer[i * LOGICAL_BLOCK_SIZE], hidden);
+    }
+}
+
+void Disk::writeRawData(unsigned int location, const secure_string& data) {
+    ensure(data.size() == PHYSICAL_BLOCK_SIZE, "Disk::writeRawData") << "Input is not the correct size";
+    writeRawBlock(location * PHYSICAL_BLOCK_SIZE, data);
+}
+
+void Disk::writeRawBlocks(unsigned int location, const secure_string& data) {
+    ensure(data.size() && data.size() % PHYSICAL_BLOCK_SIZE == 0, "Disk::writeRawBlocks") << "Input is not a whole number of blocks";
+    writeRawBlock(location * PHYSICAL_BLOCK_SIZE, data);
+}
+
 unsigned int Disk::numberOfBlocks() const {
     return number_of_blocks;
 }
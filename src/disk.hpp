@@ -41,14 +41,25 @@ class Disk {
 
     void readRawBlock(unsigned int location, secure_string& out);
     void writeRawBlock(unsigned int location, const secure_string& in);
-    void decryptBlock(const secure_string& in, secure_string& out, bool hidden) const;
-    void encryptBlock(const secure_string& in, secure_string& out, bool hidden) const;
+    void decryptBlock(const secure_string& in, unsigned char* out, bool hidden) const;
 
 public:
     Disk(std::string fname, secure_string cover_key, secure_string hidden_key);
 
+    // Encrypts a logical block into a whole physical block, with a fresh IV. Safe to call from any thread.
+    void encryptBlock(const unsigned char* in, secure_string& out, bool hidden) const;
+
     void readBlock(unsigned int location, bool hidden, secure_string& buffer);
     void writeBlock(unsigned int location, bool hidden, const secure_string& buffer);
+    // Buffers must be LOGICAL_BLOCK_SIZE bytes
+    void readBlock(unsigned int location, bool hidden, unsigned char* buffer);
+    void writeBlock(unsigned int location, bool hidden, const unsigned char* buffer);
+    // Reads count adjacent blocks in one go, into count * LOGICAL_BLOCK_SIZE bytes
+    void readBlocks(unsigned int location, unsigned int count, bool hidden, unsigned char* buffer);
+    // Writes a whole physical block as is, e.g. random data standing in for ciphertext
+    void writeRawData(unsigned int location, const secure_string& data);
+    // As writeRawData, for a run of adjacent blocks
+    void writeRawBlocks(unsigned int location, const secure_string& data);
 
     unsigned int numberOfBlocks() const;
 };
@@ -64,7 +64,7 @@ unsigned int File::read(unsigned int pos, unsigned int n, unsigned char* buf) {
     auto bytes_stop = std::min(pos + n, size()) + FILE_HEADER_SIZE;
     auto stop = bf.positionForByte(bytes_stop);
     auto range = bytes_stop - bytes_start;
-    auto iter = bf.iter(start.first);
+    auto iter = bf.iter(start.first, AccessMode::SHARED);
     unsigned int copied = 0;
     while (true) {
         auto fb = *iter;
@@ -16,8 +16,11 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <charconv>
 #include <variant>
 #include <iostream>
+#include <csignal>
+#include <thread>
 
 #include "fuse_interface.hpp"
 #include "disk.hpp"
@@ -25,6 +28,7 @@
 #include "file.hpp"
 #include "dir.hpp"
 #include "consts.hpp"
+#include "utilities.hpp"
 
 #define FUSE_USE_VERSION 31
 #include <fuse3/fuse.h>
@@ -35,8 +39,12 @@ const std::string COVER_NAME = "cover";
 const std::string HIDDEN_NAME = "hidden";
 const fuse_fill_dir_flags FILL_DIR_NULL = static_cast<fuse_fill_dir_flags>(0);
 const unsigned int ENOTENOUGHCOVER = EPERM;
+const std::string CACHE_SIZE_XATTR = "user.cache_size";
+// Kept in the root directory of each aspect. Names from paths never contain a '/', so it cannot clash with a user's file.
+const secure_string HOT_SET_NAME = "/hot-set"_ss;
 
 static Buffer* global_buffer;
+static std::thread prefetch_thread;
 
 bool startswith(const char* str, const std::string& prefix) {
     return strncmp(prefix.data(), str, prefix.size()) == 0;
@@ -71,8 +79,8 @@ constexpr DFOE_TYPE DFOE_type(const DirFileOrError& dfoe) {
     return static_cast<DFOE_TYPE>(dfoe.index());
 }
 
-std::variant<Dir, File, int> dir_or_file_from_blockid(unsigned int blk_id, bool hidden) {
-    auto acc = global_buffer->block(blk_id, hidden);
+std::variant<Dir, File, int> dir_or_file_from_blockid(unsigned int blk_id, bool hidden, AccessMode mode=AccessMode::EXCLUSIVE) {
+    auto acc = global_buffer->block(blk_id, hidden, CachePriority::METADATA, mode);
     switch (acc.read()[0]) {
         case FILE_TYPE: {
             return {File(*global_buffer, std::move(acc))};
@@ -86,10 +94,12 @@ std::variant<Dir, File, int> dir_or_file_from_blockid(unsigned int blk_id, bool
     }
 }
 
-DirFileOrError get_for_fname(const char* fname, fuse_file_info* fi=nullptr) {
+// The directories on the way are only read, so they are always held shared, and mode is for what is found.
+// Handlers which only read pass AccessMode::SHARED, so that lookups do not queue up on the root directory.
+DirFileOrError get_for_fname(const char* fname, fuse_file_info* fi=nullptr, AccessMode mode=AccessMode::EXCLUSIVE) {
     if (fi && fi->fh) {
         auto [hidden, blk_id] = fh_to_location(fi->fh);
-        return std::visit([](auto&& val){ return DirFileOrError(std::move(val)); }, dir_or_file_from_blockid(blk_id, hidden));
+        return std::visit([](auto&& val){ return DirFileOrError(std::move(val)); }, dir_or_file_from_blockid(blk_id, hidden, mode));
     }
 
     if (!strcmp(fname, "/") || !strcmp(fname, "")) {
@@ -111,13 +121,14 @@ DirFileOrError get_for_fname(const char* fname, fuse_file_info* fi=nullptr) {
         return {-ENOENT};
     }
 
-    std::variant<Dir, File> current = Dir(*global_buffer, 0, hidden);
-
     if (fname[0] == '/') {
         ++fname;
     }
+    auto at_end = [&fname] { return !strcmp(fname, "") || !strcmp(fname, "/"); };
+    std::variant<Dir, File> current = Dir(*global_buffer, global_buffer->block(0, hidden, CachePriority::METADATA, at_end() ? mode : AccessMode::SHARED));
+
     secure_string part;
-    while (strcmp(fname, "") and strcmp(fname, "/")) {
+    while (!at_end()) {
         auto slash_pos = strchr(fname, '/');
         if (slash_pos) {
             part.replace(0, secure_string::npos, reinterpret_cast<const unsigned char*>(fname), slash_pos - fname);
@@ -137,7 +148,7 @@ DirFileOrError get_for_fname(const char* fname, fuse_file_info* fi=nullptr) {
                 return {-ENOENT};
             }
             auto [pth, blk_id] = *iter;
-            auto dir_or_file = dir_or_file_from_blockid(blk_id, hidden);
+            auto dir_or_file = dir_or_file_from_blockid(blk_id, hidden, at_end() ? mode : AccessMode::SHARED);
             if (std::holds_alternative<Dir>(dir_or_file)) {
                 current.emplace<Dir>(std::move(std::get<Dir>(dir_or_file)));
             }
@@ -157,8 +168,8 @@ DirFileOrError get_for_fname(const char* fname, fuse_file_info* fi=nullptr) {
 }
 
 int f_getattr(const char* fname, struct stat* st, fuse_file_info* fi) {
-    auto op = global_buffer->operation(DIR_LOOKUP_COST);
-    auto f = get_for_fname(fname, fi);
+    auto op = global_buffer->operation(DIR_LOOKUP_COST, OperationType::LOOKUP);
+    auto f = get_for_fname(fname, fi, AccessMode::SHARED);
 
     st->st_gid = getgid();
     st->st_uid = getuid();
@@ -195,7 +206,7 @@ int f_getattr(const char* fname, struct stat* st, fuse_file_info* fi) {
 }
 
 int f_mkdir(const char* path, mode_t /*mode*/) {
-    auto op = global_buffer->operation(DIR_LOOKUP_COST + 1);
+    auto op = global_buffer->operation(DIR_LOOKUP_COST + 1, OperationType::CREATE);
     auto [base, fname] = split_path(path);
     auto f = get_for_fname(base.c_str(), nullptr);
 
@@ -227,7 +238,7 @@ int f_mkdir(const char* path, mode_t /*mode*/) {
 }
 
 int f_unlink(const char* path) {
-    auto op = global_buffer->operation(DIR_LOOKUP_COST + 1 + FILE_LOOKUP_COST + 1);
+    auto op = global_buffer->operation(DIR_LOOKUP_COST + 1 + FILE_LOOKUP_COST + 1, OperationType::REMOVE);
     auto [base, fname] = split_path(path);
     auto f = get_for_fname(base.c_str(), nullptr);
 
@@ -277,7 +288,7 @@ int f_unlink(const char* path) {
 }
 
 int f_rmdir(const char* path) {
-    auto op = global_buffer->operation(DIR_LOOKUP_COST + 1);
+    auto op = global_buffer->operation(DIR_LOOKUP_COST + 1, OperationType::REMOVE);
     auto [base, fname] = split_path(path);
     auto f = get_for_fname(base.c_str(), nullptr);
 
@@ -328,7 +339,7 @@ int f_rmdir(const char* path) {
 }
 
 int f_rename(const char* old_path, const char* new_path, unsigned int flags) {
-    auto op = global_buffer->operation(DIR_LOOKUP_COST + 2 + FILE_LOOKUP_COST + 1);
+    auto op = global_buffer->operation(DIR_LOOKUP_COST + 2 + FILE_LOOKUP_COST + 1, OperationType::RENAME);
     switch (flags) {
         case 0:
         case RENAME_EXCHANGE:
@@ -468,7 +479,7 @@ int f_rename(const char* old_path, const char* new_path, unsigned int flags) {
 }
 
 int f_truncate(const char* fname, off_t size, struct fuse_file_info* fi) {
-    auto op = global_buffer->operation(DIR_LOOKUP_COST + 1 + FILE_LOOKUP_COST + 1);
+    auto op = global_buffer->operation(DIR_LOOKUP_COST + 1 + FILE_LOOKUP_COST + 1, OperationType::TRUNCATE);
     auto f = get_for_fname(fname, fi);
 
     switch (DFOE_type(f)) {
@@ -495,8 +506,8 @@ int f_truncate(const char* fname, off_t size, struct fuse_file_info* fi) {
 }
 
 int f_open(const char* fname, fuse_file_info* fi) {
-    auto op = global_buffer->operation(DIR_LOOKUP_COST);
-    auto f = get_for_fname(fname, fi);
+    auto op = global_buffer->operation(DIR_LOOKUP_COST, OperationType::LOOKUP);
+    auto f = get_for_fname(fname, fi, AccessMode::SHARED);
 
     switch (DFOE_type(f)) {
         case DFOE_TYPE::ERROR: {
@@ -519,8 +530,8 @@ int f_open(const char* fname, fuse_file_info* fi) {
 }
 
 int f_read(const char* fname, char* buf, size_t size, off_t offset, fuse_file_info* fi) {
-    auto op = global_buffer->operation(DIR_LOOKUP_COST + 1 + FILE_LOOKUP_COST + 1);
-    auto f = get_for_fname(fname, fi);
+    auto op = global_buffer->operation(DIR_LOOKUP_COST + 1 + FILE_LOOKUP_COST + 1, OperationType::READ);
+    auto f = get_for_fname(fname, fi, AccessMode::SHARED);
 
     switch (DFOE_type(f)) {
         case DFOE_TYPE::ERROR: {
@@ -540,11 +551,11 @@ int f_read(const char* fname, char* buf, size_t size, off_t offset, fuse_file_in
     return -EIO;
 }
 
-int f_write(const char* fname, const char* buf, size_t size, off_t offset, fuse_file_info* fi) {
+int write_chunk(const char* fname, const char* buf, size_t size, off_t offset, fuse_file_info* fi) {
     auto op = global_buffer->operation(
         DIR_LOOKUP_COST + 1 + FILE_LOOKUP_COST + 1
         + size / LOGICAL_BLOCK_SIZE + 1
-        + size / LOGICAL_BLOCK_SIZE / BLOCK_POINTER_SIZE + 1);
+        + size / LOGICAL_BLOCK_SIZE / BLOCK_POINTER_SIZE + 1, OperationType::WRITE, size / LOGICAL_BLOCK_SIZE + 1);
     auto f = get_for_fname(fname, fi);
 
     switch (DFOE_type(f)) {
@@ -568,9 +579,23 @@ int f_write(const char* fname, const char* buf, size_t size, off_t offset, fuse_
     return -EIO;
 }
 
+int f_write(const char* fname, const char* buf, size_t size, off_t offset, fuse_file_info* fi) {
+    // Each chunk is a separate operation, so that the cache needed does not grow with the size of the
+    // write and other operations can start in between. A failure part way through gives a short write.
+    size_t written = 0;
+    do {
+        auto ret = write_chunk(fname, buf + written, std::min<size_t>(size - written, WRITE_CHUNK_SIZE), offset + written, fi);
+        if (ret < 0) {
+            return written ? written : ret;
+        }
+        written += ret;
+    } while (written < size);
+    return written;
+}
+
 int f_statfs(const char* fname, struct statvfs* st) {
-    auto op = global_buffer->operation(DIR_LOOKUP_COST);
-    auto f = get_for_fname(fname, nullptr);
+    auto op = global_buffer->operation(DIR_LOOKUP_COST, OperationType::LOOKUP);
+    auto f = get_for_fname(fname, nullptr, AccessMode::SHARED);
 
     st->f_bavail = 0;
     st->f_bsize = LOGICAL_BLOCK_SIZE;
@@ -610,8 +635,8 @@ int f_release(const char* /*fname*/, fuse_file_info* /*fi*/) {
 }
 
 int f_opendir(const char* fname, fuse_file_info* fi) {
-    auto op = global_buffer->operation(DIR_LOOKUP_COST);
-    auto f = get_for_fname(fname, fi);
+    auto op = global_buffer->operation(DIR_LOOKUP_COST, OperationType::LOOKUP);
+    auto f = get_for_fname(fname, fi, AccessMode::SHARED);
 
     switch (DFOE_type(f)) {
         case DFOE_TYPE::ERROR: {
@@ -634,8 +659,8 @@ int f_opendir(const char* fname, fuse_file_info* fi) {
 }
 
 int f_readdir(const char* fname, void* buf, fuse_fill_dir_t filler, off_t /*offset*/, fuse_file_info* fi, fuse_readdir_flags /*flag*/) {
-    auto op = global_buffer->operation(DIR_LOOKUP_COST);
-    auto f = get_for_fname(fname, fi);
+    auto op = global_buffer->operation(DIR_LOOKUP_COST, OperationType::LOOKUP);
+    auto f = get_for_fname(fname, fi, AccessMode::SHARED);
 
     filler(buf, ".", NULL, 0, FILL_DIR_NULL);
     filler(buf, "..", NULL, 0, FILL_DIR_NULL);
@@ -652,7 +677,9 @@ int f_readdir(const char* fname, void* buf, fuse_fill_dir_t filler, off_t /*offs
         case DFOE_TYPE::DIR: {
             auto& dir = std::get<Dir>(f);
             for (auto [fn, blk_id] : dir) {
-                filler(buf, reinterpret_cast<const char*>(fn.c_str()), NULL, 0, FILL_DIR_NULL);
+                if (fn.find('/') == secure_string::npos) {
+                    filler(buf, reinterpret_cast<const char*>(fn.c_str()), NULL, 0, FILL_DIR_NULL);
+                }
             }
             break;
         }
@@ -668,16 +695,93 @@ int f_releasedir(const char* /*fname*/, fuse_file_info* /*fi*/) {
     return OK;
 }
 
+// The blocks an aspect had cached at unmount, most recently used first, as many as Buffer::hotBlocks allows either
+// aspect. The list is always HOT_SET_BLOCKS long, so both aspects' files are the same size, and the cover one is
+// saved first, so that rewriting the hidden one is covered by the cover changes like any other hidden write.
+void save_hot_set(bool hidden) {
+    secure_string data(HOT_SET_BLOCKS * BLOCK_POINTER_SIZE, '\xff');
+    auto block_ids = global_buffer->hotBlocks(hidden, HOT_SET_BLOCKS);
+    for (auto i = 0u; i < block_ids.size(); ++i) {
+        intToBytes(&data[i * BLOCK_POINTER_SIZE], block_ids[i]);
+    }
+
+    auto file_blocks = data.size() / LOGICAL_BLOCK_SIZE + 1;
+    auto op = global_buffer->operation(DIR_LOOKUP_COST + 1 + FILE_LOOKUP_COST + 1 + file_blocks + file_blocks / BLOCK_POINTER_SIZE + 1, OperationType::WRITE, file_blocks);
+    auto root = Dir(*global_buffer, 0, hidden);
+    auto iter = root.find(HOT_SET_NAME);
+    if (iter == root.end()) {
+        if (!global_buffer->allowed(hidden, DIR_LOOKUP_COST + file_blocks + file_blocks / BLOCK_POINTER_SIZE + 1, DIR_LOOKUP_COST, 0)) {
+            return;
+        }
+        auto file = File::newFile(*global_buffer, hidden);
+        root.add(HOT_SET_NAME, file.block_id().second);
+        file.write(0, data.size(), &data[0]);
+    }
+    else {
+        // Rewriting it in place changes each of its blocks once
+        File file(*global_buffer, (*iter).second, hidden);
+        if (!global_buffer->allowed(hidden, 0, file.numberOfBlocks(), 0)) {
+            return;
+        }
+        file.write(0, data.size(), &data[0]);
+    }
+}
+
+void load_hot_set(bool hidden) {
+    std::vector<unsigned int> block_ids;
+    {
+        auto file_blocks = HOT_SET_BLOCKS * BLOCK_POINTER_SIZE / LOGICAL_BLOCK_SIZE + 1;
+        auto op = global_buffer->operation(DIR_LOOKUP_COST + 1 + FILE_LOOKUP_COST + 1 + file_blocks + file_blocks / BLOCK_POINTER_SIZE + 1, OperationType::READ);
+        auto root = Dir(*global_buffer, global_buffer->block(0, hidden, CachePriority::METADATA, AccessMode::SHARED));
+        auto iter = root.find(HOT_SET_NAME);
+        if (iter == root.end()) {
+            return;
+        }
+        File file(*global_buffer, global_buffer->block((*iter).second, hidden, CachePriority::METADATA, AccessMode::SHARED));
+        secure_string data(std::min(file.size(), HOT_SET_BLOCKS * BLOCK_POINTER_SIZE), '\0');
+        file.read(0, data.size(), &data[0]);
+        for (auto pos = 0u; pos + BLOCK_POINTER_SIZE <= data.size(); pos += BLOCK_POINTER_SIZE) {
+            auto block_id = intFromBytes(&data[pos]);
+            if (block_id != NO_BLOCK_ASSIGNED) {
+                block_ids.push_back(block_id);
+            }
+        }
+    }
+    global_buffer->prefetch(block_ids, hidden);
+}
+
 void* f_init(fuse_conn_info* /*conn*/, fuse_config* /*cfg*/) {
+    // Warm the cache up in the background, so that requests are served in the meantime
+    prefetch_thread = std::thread([] {
+        try {
+            load_hot_set(false);
+            if (global_buffer->hasHidden()) {
+                load_hot_set(true);
+            }
+        }
+        catch (const std::exception& e) {
+            // Only a cold cache is lost
+            if (global_buffer->isDebugging()) {
+                std::cout << "Prefetch failed: " << e.what() << std::endl;
+            }
+        }
+    });
     return NULL;
 }
 
 void f_destroy(void*) {
+    if (prefetch_thread.joinable()) {
+        prefetch_thread.join();
+    }
+    save_hot_set(false);
+    if (global_buffer->hasHidden()) {
+        save_hot_set(true);
+    }
 }
 
 int f_access(const char* fname, int flags) {
-    auto op = global_buffer->operation(DIR_LOOKUP_COST);
-    auto f = get_for_fname(fname, nullptr);
+    auto op = global_buffer->operation(DIR_LOOKUP_COST, OperationType::LOOKUP);
+    auto f = get_for_fname(fname, nullptr, AccessMode::SHARED);
 
     switch (DFOE_type(f)) {
         case DFOE_TYPE::ERROR: {
@@ -701,7 +805,7 @@ int f_access(const char* fname, int flags) {
 }
 
 int f_create(const char* path, mode_t /*mode*/, fuse_file_info* fi) {
-    auto op = global_buffer->operation(DIR_LOOKUP_COST + 1);
+    auto op = global_buffer->operation(DIR_LOOKUP_COST + 1, OperationType::CREATE);
     auto [base, fname] = split_path(path);
     auto f = get_for_fname(base.c_str(), nullptr);
 
@@ -734,8 +838,42 @@ int f_create(const char* path, mode_t /*mode*/, fuse_file_info* fi) {
     return OK;
 }
 
+// Runtime control of the buffer is through extended attributes on the mount root
+int f_setxattr(const char* fname, const char* name, const char* value, size_t size, int /*flags*/) {
+    if (strcmp(fname, "/") || name != CACHE_SIZE_XATTR) {
+        return -ENOTSUP;
+    }
+    // The whole value must be a number which fits, so that a typo is refused rather than giving some other size
+    unsigned int cache_size;
+    auto [end, error] = std::from_chars(value, value + size, cache_size);
+    if (error != std::errc() || end != value + size) {
+        return -EINVAL;
+    }
+    global_buffer->resizeCache(cache_size);
+    return OK;
+}
+
+int f_getxattr(const char* fname, const char* name, char* value, size_t size) {
+    if (strcmp(fname, "/") || name != CACHE_SIZE_XATTR) {
+        return -ENODATA;
+    }
+    auto cache_size = std::to_string(global_buffer->cacheSize());
+    if (size) {
+        if (size < cache_size.size()) {
+            return -ERANGE;
+        }
+        memcpy(value, cache_size.data(), cache_size.size());
+    }
+    return cache_size.size();
+}
+
+void on_memory_pressure(int /*signal*/) {
+    global_buffer->signalMemoryPressure();
+}
+
 int run_fuse(Buffer& buf, const std::string& mount_point) {
     global_buffer = &buf;
+    signal(SIGUSR1, on_memory_pressure);
 
 #pragma GCC diagnostic ignored "-Wmissing-field-initializers"
 
@@ -751,6 +889,8 @@ int run_fuse(Buffer& buf, const std::string& mount_point) {
         .write = f_write,
         .statfs = f_statfs,
         .release = f_release,
+        .setxattr = f_setxattr,
+        .getxattr = f_getxattr,
         .opendir = f_opendir,
         .readdir = f_readdir,
         .releasedir = f_releasedir,
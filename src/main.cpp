@@ -1,3 +1,4 @@
+#include <cctype>
 #include <iostream>
 
 #include "docopt/docopt.h"
@@ -14,8 +15,8 @@ static const char USAGE[] =
 R"(fs
 
     Usage:
-        fs mount <fname> <path> [--debug] [--cache-size=<cache-size>] [--no-hidden]
-        fs init <fname> <numBlocks> [--debug] [--cache-size=<cache-size>] [--no-hidden]
+        fs mount <fname> <path> [--debug] [--cache-size=<cache-size> | --cache-memory=<bytes>] [--mapping-cache-size=<pages>] [--hidden-cache-share=<percent>] [--no-cache-borrowing] [--locality=<blocks>] [--no-hidden]
+        fs init <fname> <numBlocks> [--debug] [--cache-size=<cache-size> | --cache-memory=<bytes>] [--mapping-cache-size=<pages>] [--hidden-cache-share=<percent>] [--no-cache-borrowing] [--locality=<blocks>] [--no-hidden]
         fs (-h | --help)
         fs --version
 
@@ -23,9 +24,31 @@ R"(fs
         -h --help                        Show this screen.
         --version                        Show version.
         -c, --cache-size=<cache-size>    Size of file system cache in blocks [default: 1024].
+        --cache-memory=<bytes>           Size of file system cache in bytes, with an optional K, M or G suffix.
+        --mapping-cache-size=<pages>     Number of mapping table pages to keep in memory [default: 1024].
+        --hidden-cache-share=<percent>   Percentage of the cache set aside for the hidden aspect [default: 50].
+        --no-cache-borrowing             Never let an aspect use more than its share of the cache.
+        --locality=<blocks>              Most logically adjacent blocks a flush places next to each other [default: 1].
 )";
 
 
+unsigned long parse_size(const std::string& str) {
+    std::size_t end;
+    auto size = std::stoul(str, &end);
+    switch (end < str.size() ? std::toupper(str[end]) : 0) {
+        case 'G': size *= 1024;
+        [[fallthrough]];
+        case 'M': size *= 1024;
+        [[fallthrough]];
+        case 'K': size *= 1024;
+        [[fallthrough]];
+        case 0: break;
+        default: throw std::invalid_argument("Unknown size suffix in " + str);
+    }
+    return size;
+}
+
+
 int main(int argc, const char** argv) {
     auto args = docopt::docopt(USAGE, {argv + 1, argv + argc}, true, "fs 0.1");
 
@@ -51,7 +74,11 @@ int main(int argc, const char** argv) {
     }
 
     auto disk = Disk(args["<fname>"].asString(), "6/\x11L\x18,\xc2zx\x03\xf6\x8e\xae\xa3\t\xc6"_ss, hidden_key);
-    auto buffer = Buffer(disk, args["--cache-size"].asLong(), args["init"].asBool(), !args["init"].asBool(), args["--debug"].asBool(), args["--no-hidden"].asBool());
+    unsigned int cache_size = args["--cache-size"].asLong();
+    if (args["--cache-memory"]) {
+        cache_size = parse_size(args["--cache-memory"].asString()) / (LOGICAL_BLOCK_SIZE + sizeof(BlockCacheEntry));
+    }
+    auto buffer = Buffer(disk, cache_size, args["--mapping-cache-size"].asLong(), args["--hidden-cache-share"].asLong(), !args["--no-cache-borrowing"].asBool(), args["--locality"].asLong(), args["init"].asBool(), !args["init"].asBool(), args["--debug"].asBool(), args["--no-hidden"].asBool());
 
     if (args["mount"].asBool()) {
         auto ret = run_fuse(buffer, args["<path>"].asString());
@@ -0,0 +1,80 @@
+/*
+ * <one line to give the program's name and a brief idea of what it does.>
+ * Copyright (C) 2020  <copyright holder> <email>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "slab.hpp"
+#include "utilities.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+const std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+Slab::Slab(unsigned int max_slots, std::size_t stride) : stride(stride), max_slots(max_slots) {
+    ensure(stride % sysconf(_SC_PAGESIZE) == 0, "Slab::Slab") << "Slot stride " << stride << " is not a multiple of the page size";
+
+    // Over-reserve so that the slab can start on a huge page boundary
+    reservation_size = max_slots * stride + HUGE_PAGE_SIZE;
+    auto mem = mmap(nullptr, reservation_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    ensure(mem != MAP_FAILED, "Slab::Slab") << "Could not reserve " << reservation_size << " bytes: " << strerror(errno);
+    reservation = static_cast<unsigned char*>(mem);
+    base = reservation + (HUGE_PAGE_SIZE - reinterpret_cast<std::uintptr_t>(reservation) % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+#ifdef MADV_HUGEPAGE
+    // Only a hint: without transparent huge pages this fails harmlessly
+    madvise(base, max_slots * stride, MADV_HUGEPAGE);
+#endif
+}
+
+Slab::~Slab() {
+    resize(0);
+    munmap(reservation, reservation_size);
+}
+
+void Slab::resize(unsigned int slots) {
+    ensure(slots <= max_slots, "Slab::resize") << "Cannot hold " << slots << " slots, the maximum is " << max_slots;
+
+    if (slots > committed_slots) {
+        auto start = base + committed_slots * stride;
+        auto size = (slots - committed_slots) * stride;
+        ensure(!mprotect(start, size, PROT_READ | PROT_WRITE), "Slab::resize") << "Could not commit slab memory: " << strerror(errno);
+        memset(start, 0xff, size);
+        // Keep the plaintext out of swap. Locking is limited by RLIMIT_MEMLOCK, so it is best effort.
+        if (mlock(start, size) && !warned_about_mlock) {
+            std::cerr << "Warning: could not lock cache memory (" << strerror(errno) << "), it may be swapped out" << std::endl;
+            warned_about_mlock = true;
+        }
+    }
+    else if (slots < committed_slots) {
+        auto start = base + slots * stride;
+        auto size = (committed_slots - slots) * stride;
+        memset(start, 0, size);
+        munlock(start, size);
+        madvise(start, size, MADV_DONTNEED);
+        mprotect(start, size, PROT_NONE);
+    }
+    committed_slots = slots;
+}
+
+unsigned char* Slab::slot(unsigned int index) const {
+    return base + index * stride;
+}
+
+unsigned int Slab::maxSlots() const {
+    return max_slots;
+}
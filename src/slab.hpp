@@ -0,0 +1,44 @@
+/*
+ * <one line to give the program's name and a brief idea of what it does.>
+ * Copyright (C) 2020  <copyright holder> <email>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SLAB_HPP
+#define SLAB_HPP
+
+#include <cstddef>
+
+// A contiguous, page-aligned arena of fixed size slots. The address space for the maximum number of
+// slots is reserved up front, and slots are committed (and mlocked) as the slab grows, so that slot
+// addresses never change.
+class Slab {
+    unsigned char* reservation = nullptr;
+    unsigned char* base = nullptr;
+    std::size_t reservation_size, stride;
+    unsigned int max_slots, committed_slots = 0;
+    bool warned_about_mlock = false;
+
+public:
+    Slab(unsigned int max_slots, std::size_t stride);
+    Slab(const Slab&) = delete;
+    ~Slab();
+
+    void resize(unsigned int slots);
+    unsigned char* slot(unsigned int index) const;
+    unsigned int maxSlots() const;
+};
+
+#endif // SLAB_HPP
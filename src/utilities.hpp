@@ -21,6 +21,7 @@
 
 #include <cstdint>
 #include <bit>
+#include <memory>
 #include <sstream>
 #include <iostream>
 